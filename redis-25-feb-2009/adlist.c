@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include "adlist.h"
+#include "slab.h"
 
 /* Create a new list. The created list can be freed with
  * AlFreeList(), but private value of every node need to be freed
@@ -37,7 +38,7 @@ void listRelease(list *list)
     while(len--) {
         next = current->next;
         if (list->free) list->free(current->value);
-        free(current);
+        slabFree(current,sizeof(*current));
         current = next;
     }
     free(list);
@@ -53,7 +54,7 @@ list *listAddNodeHead(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = malloc(sizeof(*node))) == NULL)
+    if ((node = slabAlloc(sizeof(*node))) == NULL)
         return NULL;
     node->value = value;
     if (list->len == 0) {
@@ -79,7 +80,7 @@ list *listAddNodeTail(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = malloc(sizeof(*node))) == NULL)
+    if ((node = slabAlloc(sizeof(*node))) == NULL)
         return NULL;
     node->value = value;
     if (list->len == 0) {
@@ -110,7 +111,7 @@ void listDelNode(list *list, listNode *node)
     else
         list->tail = node->prev;
     if (list->free) list->free(node->value);
-    free(node);
+    slabFree(node,sizeof(*node));
     list->len--;
 }
 
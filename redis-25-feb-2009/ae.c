@@ -10,27 +10,92 @@
 #include "ae.h"
 
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "config.h"
+
+/* Include the best multiplexing layer supported by this system.
+ * The following should be ordered by performances, descending. */
+#if defined(HAVE_IO_URING)
+#include "ae_iouring.c"
+#elif defined(HAVE_EPOLL)
+#include "ae_epoll.c"
+#else
+#include "ae_select.c"
+#endif
+
 aeEventLoop *aeCreateEventLoop(void) {
     aeEventLoop *eventLoop;
+    int i;
 
     eventLoop = malloc(sizeof(*eventLoop));
     if (!eventLoop) return NULL;
-    eventLoop->fileEventHead = NULL;
-    eventLoop->timeEventHead = NULL;
+    eventLoop->setsize = AE_SETSIZE;
+    eventLoop->events = malloc(sizeof(aeFileEvent)*eventLoop->setsize);
+    eventLoop->fired = malloc(sizeof(aeFiredEvent)*eventLoop->setsize);
+    if (!eventLoop->events || !eventLoop->fired) goto err;
+    if (aeApiCreate(eventLoop) == -1) goto err;
+    /* Events with mask == AE_NONE are not set. So let's initialize the
+     * vector with it. */
+    for (i = 0; i < eventLoop->setsize; i++)
+        eventLoop->events[i].mask = AE_NONE;
+    eventLoop->maxfd = -1;
+    eventLoop->timeEvents = NULL;
+    eventLoop->timeEventsLen = 0;
+    eventLoop->timeEventsSize = 0;
+    eventLoop->timeEventsSkipped = NULL;
+    eventLoop->timeEventsSkippedLen = 0;
+    eventLoop->timeEventRunning = NULL;
+    eventLoop->timeEventRunningDeleted = 0;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
+    eventLoop->beforesleep = NULL;
     return eventLoop;
+
+err:
+    free(eventLoop->events);
+    free(eventLoop->fired);
+    free(eventLoop);
+    return NULL;
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+
+    for (j = 0; j < eventLoop->timeEventsLen; j++)
+        free(eventLoop->timeEvents[j]);
+    free(eventLoop->timeEvents);
+    aeApiFree(eventLoop);
+    free(eventLoop->events);
+    free(eventLoop->fired);
     free(eventLoop);
 }
 
+/* Grow the fd indexed tables so that 'fd' fits. The size is doubled
+ * every time, so the number of reallocations is logarithmic. */
+static int aeResizeSetSize(aeEventLoop *eventLoop, int fd) {
+    int setsize = eventLoop->setsize, i;
+    aeFileEvent *events;
+    aeFiredEvent *fired;
+
+    while (setsize <= fd) setsize *= 2;
+    if (aeApiResize(eventLoop, setsize) == -1) return AE_ERR;
+    events = realloc(eventLoop->events, sizeof(aeFileEvent)*setsize);
+    if (!events) return AE_ERR;
+    eventLoop->events = events;
+    fired = realloc(eventLoop->fired, sizeof(aeFiredEvent)*setsize);
+    if (!fired) return AE_ERR;
+    eventLoop->fired = fired;
+    for (i = eventLoop->setsize; i < setsize; i++)
+        eventLoop->events[i].mask = AE_NONE;
+    eventLoop->setsize = setsize;
+    return AE_OK;
+}
+
 void aeStop(aeEventLoop *eventLoop) {
     eventLoop->stop = 1;
 }
@@ -41,60 +106,149 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
 {
     aeFileEvent *fe;
 
-    fe = malloc(sizeof(*fe));
-    if (fe == NULL) return AE_ERR;
-    fe->fd = fd;
-    fe->mask = mask;
-    fe->fileProc = proc;
+    if (fd >= eventLoop->setsize &&
+        aeResizeSetSize(eventLoop, fd) == AE_ERR) return AE_ERR;
+    fe = &eventLoop->events[fd];
+    if (aeApiAddEvent(eventLoop, fd, mask) == -1)
+        return AE_ERR;
+    fe->mask |= mask;
+    if (mask & AE_READABLE) fe->rfileProc = proc;
+    if (mask & AE_WRITABLE) fe->wfileProc = proc;
+    if (mask & AE_EXCEPTION) fe->efileProc = proc;
     fe->finalizerProc = finalizerProc;
     fe->clientData = clientData;
-    fe->next = eventLoop->fileEventHead;
-    eventLoop->fileEventHead = fe;
+    if (fd > eventLoop->maxfd)
+        eventLoop->maxfd = fd;
     return AE_OK;
 }
 
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 {
-    aeFileEvent *fe, *prev = NULL;
-
-    fe = eventLoop->fileEventHead;
-    while(fe) {
-        if (fe->fd == fd && fe->mask == mask) {
-            if (prev == NULL)
-                eventLoop->fileEventHead = fe->next;
-            else
-                prev->next = fe->next;
-            if (fe->finalizerProc)
-                fe->finalizerProc(eventLoop, fe->clientData);
-            free(fe);
-            return;
-        }
-        prev = fe;
-        fe = fe->next;
+    aeFileEvent *fe;
+
+    if (fd >= eventLoop->setsize) return;
+    fe = &eventLoop->events[fd];
+    if (!(fe->mask & mask)) return;
+    aeApiDelEvent(eventLoop, fd, mask);
+    fe->mask = fe->mask & (~mask);
+    if (fe->mask != AE_NONE) return;
+
+    /* This was the last event of the fd */
+    if (fd == eventLoop->maxfd) {
+        /* Update the max fd */
+        int j;
+
+        for (j = eventLoop->maxfd-1; j >= 0; j--)
+            if (eventLoop->events[j].mask != AE_NONE) break;
+        eventLoop->maxfd = j;
     }
+    if (fe->finalizerProc)
+        fe->finalizerProc(eventLoop, fe->clientData);
+}
+
+/* Return the mask of the events registered for 'fd' */
+int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
+    if (fd >= eventLoop->setsize) return AE_NONE;
+    return eventLoop->events[fd].mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
+/* Return the current time in microseconds, measured from some unspecified
+ * point in the past. CLOCK_MONOTONIC is used when available so that timers
+ * are not affected by adjustments of the wall clock. */
+static long long aeGetMonotonicUs(void)
 {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+#else
     struct timeval tv;
 
     gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+    return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+#endif
+}
+
+/* ------------------------ Time events min-heap ---------------------------- */
+
+static void aeTimeHeapSet(aeEventLoop *eventLoop, int idx, aeTimeEvent *te) {
+    eventLoop->timeEvents[idx] = te;
+    te->heapidx = idx;
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+/* Move the element at 'idx' up until its parent fires before it */
+static void aeTimeHeapUp(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEvents[idx];
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+    while (idx > 0) {
+        int parent = (idx-1)/2;
+
+        if (eventLoop->timeEvents[parent]->when <= te->when) break;
+        aeTimeHeapSet(eventLoop, idx, eventLoop->timeEvents[parent]);
+        idx = parent;
+    }
+    aeTimeHeapSet(eventLoop, idx, te);
+}
+
+/* Move the element at 'idx' down until both children fire after it */
+static void aeTimeHeapDown(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEvents[idx];
+    int len = eventLoop->timeEventsLen;
+
+    while (1) {
+        int child = idx*2+1;
+
+        if (child >= len) break;
+        if (child+1 < len && eventLoop->timeEvents[child+1]->when <
+                             eventLoop->timeEvents[child]->when)
+            child++;
+        if (te->when <= eventLoop->timeEvents[child]->when) break;
+        aeTimeHeapSet(eventLoop, idx, eventLoop->timeEvents[child]);
+        idx = child;
+    }
+    aeTimeHeapSet(eventLoop, idx, te);
+}
+
+/* Restore the heap property after the 'when' of 'te' changed */
+static void aeTimeHeapFix(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimeHeapUp(eventLoop, te->heapidx);
+    aeTimeHeapDown(eventLoop, te->heapidx);
+}
+
+/* The heap always has room for the skipped events too, so that putting
+ * them back can't fail. */
+static int aeTimeHeapPush(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeEventsLen+eventLoop->timeEventsSkippedLen ==
+        eventLoop->timeEventsSize)
+    {
+        int size = eventLoop->timeEventsSize ? eventLoop->timeEventsSize*2 : 16;
+        aeTimeEvent **heap;
+
+        heap = realloc(eventLoop->timeEvents, sizeof(aeTimeEvent*)*size);
+        if (heap == NULL) return AE_ERR;
+        eventLoop->timeEvents = heap;
+        eventLoop->timeEventsSize = size;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    aeTimeHeapSet(eventLoop, eventLoop->timeEventsLen++, te);
+    aeTimeHeapUp(eventLoop, te->heapidx);
+    return AE_OK;
+}
+
+static void aeTimeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int idx = te->heapidx;
+    aeTimeEvent *last = eventLoop->timeEvents[--eventLoop->timeEventsLen];
+
+    if (last == te) return;
+    aeTimeHeapSet(eventLoop, idx, last);
+    aeTimeHeapFix(eventLoop, last);
+}
+
+/* Free a time event already removed from the heap */
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    free(te);
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
@@ -107,33 +261,48 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
     te = malloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
     te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    te->when = aeGetMonotonicUs() + milliseconds*1000;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
+    if (aeTimeHeapPush(eventLoop, te) == AE_ERR) {
+        free(te);
+        return AE_ERR;
+    }
     return id;
 }
 
+/* Note that looking up the event by ID is O(N), but it's just a scan of
+ * a small array of pointers, the removal itself is O(log(N)). */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te, *prev = NULL;
+    aeTimeEvent *te, **prev;
+    int j;
 
-    te = eventLoop->timeEventHead;
-    while(te) {
+    for (j = 0; j < eventLoop->timeEventsLen; j++) {
+        te = eventLoop->timeEvents[j];
+
+        if (te->id != id) continue;
+        /* The handler of this very event is running: aeProcessEvents()
+         * will release it when the handler returns. */
+        if (te == eventLoop->timeEventRunning) {
+            eventLoop->timeEventRunningDeleted = 1;
+            return AE_OK;
+        }
+        aeTimeHeapRemove(eventLoop, te);
+        aeFreeTimeEvent(eventLoop, te);
+        return AE_OK;
+    }
+    /* Not in the heap: maybe skipped by the processTimeEvents() running */
+    prev = &eventLoop->timeEventsSkipped;
+    while ((te = *prev) != NULL) {
         if (te->id == id) {
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            free(te);
+            *prev = te->next;
+            eventLoop->timeEventsSkippedLen--;
+            aeFreeTimeEvent(eventLoop, te);
             return AE_OK;
         }
-        prev = te;
-        te = te->next;
+        prev = &te->next;
     }
     return AE_ERR; /* NO event with the specified ID found */
 }
@@ -143,20 +312,53 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
  *
- * Note that's O(N) since time events are unsorted. */
+ * It's O(1) since the nearest timer is the root of the heap. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
+    return eventLoop->timeEventsLen ? eventLoop->timeEvents[0] : NULL;
+}
+
+/* Process every time event that is due. Events registered by the
+ * handlers themselves are not processed in this call, in order to don't
+ * loop forever: when they are due they are removed from the heap, so that
+ * the events behind them are still processed, and put back at the end. */
+static int processTimeEvents(aeEventLoop *eventLoop) {
+    int processed = 0;
+    long long maxId = eventLoop->timeEventNextId-1;
+    long long now = aeGetMonotonicUs();
+    aeTimeEvent *te;
+
+    while (eventLoop->timeEventsLen) {
+        int retval;
+
+        te = eventLoop->timeEvents[0];
+        if (te->when > now) break;
+        if (te->id > maxId) {
+            aeTimeHeapRemove(eventLoop, te);
+            te->next = eventLoop->timeEventsSkipped;
+            eventLoop->timeEventsSkipped = te;
+            eventLoop->timeEventsSkippedLen++;
+            continue;
+        }
+        eventLoop->timeEventRunning = te;
+        eventLoop->timeEventRunningDeleted = 0;
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        eventLoop->timeEventRunning = NULL;
+        processed++;
+        if (retval == AE_NOMORE || eventLoop->timeEventRunningDeleted) {
+            aeTimeHeapRemove(eventLoop, te);
+            aeFreeTimeEvent(eventLoop, te);
+        } else {
+            te->when = aeGetMonotonicUs() + (long long)retval*1000;
+            aeTimeHeapFix(eventLoop, te);
+        }
+    }
+    while ((te = eventLoop->timeEventsSkipped) != NULL) {
+        eventLoop->timeEventsSkipped = te->next;
+        eventLoop->timeEventsSkippedLen--;
+        aeTimeHeapPush(eventLoop, te);
     }
-    return nearest;
+    return processed;
 }
 
 /* Process every pending time event, then every pending file event
@@ -174,56 +376,32 @@ static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
  * The function returns the number of events processed. */
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 {
-    int maxfd = 0, numfd = 0, processed = 0;
-    fd_set rfds, wfds, efds;
-    aeFileEvent *fe = eventLoop->fileEventHead;
-    aeTimeEvent *te;
-    long long maxId;
+    int processed = 0, numevents, j;
     AE_NOTUSED(flags);
 
     /* Nothing to do? return ASAP */
     if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
 
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
-
-    /* Check file events */
-    if (flags & AE_FILE_EVENTS) {
-        while (fe != NULL) {
-            if (fe->mask & AE_READABLE) FD_SET(fe->fd, &rfds);
-            if (fe->mask & AE_WRITABLE) FD_SET(fe->fd, &wfds);
-            if (fe->mask & AE_EXCEPTION) FD_SET(fe->fd, &efds);
-            if (maxfd < fe->fd) maxfd = fe->fd;
-            numfd++;
-            fe = fe->next;
-        }
-    }
-    /* Note that we want call select() even if there are no
+    /* Note that we want call the polling API even if there are no
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
      * to fire. */
-    if (numfd || ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
-        int retval;
+    if (((flags & AE_FILE_EVENTS) && eventLoop->maxfd != -1) ||
+        ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
         aeTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
         if (shortest) {
-            long now_sec, now_ms;
-
             /* Calculate the time missing for the nearest
              * timer to fire. */
-            aeGetTime(&now_sec, &now_ms);
+            long long us = shortest->when - aeGetMonotonicUs();
+
+            if (us < 0) us = 0;
             tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
-            if (shortest->when_ms < now_ms) {
-                tvp->tv_usec = ((shortest->when_ms+1000) - now_ms)*1000;
-                tvp->tv_sec --;
-            } else {
-                tvp->tv_usec = (shortest->when_ms - now_ms)*1000;
-            }
+            tvp->tv_sec = us/1000000;
+            tvp->tv_usec = us%1000000;
         } else {
             /* If we have to check for events but need to return
              * ASAP because of AE_DONT_WAIT we need to se the timeout
@@ -237,82 +415,58 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
         }
 
-        retval = select(maxfd+1, &rfds, &wfds, &efds, tvp);
-        if (retval > 0) {
-            fe = eventLoop->fileEventHead;
-            while(fe != NULL) {
-                int fd = (int) fe->fd;
-
-                if ((fe->mask & AE_READABLE && FD_ISSET(fd, &rfds)) ||
-                    (fe->mask & AE_WRITABLE && FD_ISSET(fd, &wfds)) ||
-                    (fe->mask & AE_EXCEPTION && FD_ISSET(fd, &efds)))
-                {
-                    int mask = 0;
-
-                    if (fe->mask & AE_READABLE && FD_ISSET(fd, &rfds))
-                        mask |= AE_READABLE;
-                    if (fe->mask & AE_WRITABLE && FD_ISSET(fd, &wfds))
-                        mask |= AE_WRITABLE;
-                    if (fe->mask & AE_EXCEPTION && FD_ISSET(fd, &efds))
-                        mask |= AE_EXCEPTION;
-                    fe->fileProc(eventLoop, fe->fd, fe->clientData, mask);
-                    processed++;
-                    /* After an event is processed our file event list
-                     * may no longer be the same, so what we do
-                     * is to clear the bit for this file descriptor and
-                     * restart again from the head. */
-                    fe = eventLoop->fileEventHead;
-                    FD_CLR(fd, &rfds);
-                    FD_CLR(fd, &wfds);
-                    FD_CLR(fd, &efds);
-                } else {
-                    fe = fe->next;
-                }
+        numevents = aeApiPoll(eventLoop, tvp);
+        for (j = 0; j < numevents && (flags & AE_FILE_EVENTS); j++) {
+            int fd = eventLoop->fired[j].fd;
+            int mask = eventLoop->fired[j].mask;
+            aeFileEvent *fe = &eventLoop->events[fd];
+
+            /* Note the fe->mask & mask & ... code: maybe an already
+             * processed event removed an element that fired and we
+             * still didn't processed, so we check if the event is still
+             * valid. The events table may also be reallocated by a
+             * handler registering a new fd, so fe is fetched again
+             * after every call. */
+            if (fe->mask & mask & AE_READABLE) {
+                fe->rfileProc(eventLoop,fd,fe->clientData,AE_READABLE);
+                processed++;
             }
-        }
-    }
-    /* Check time events */
-    if (flags & AE_TIME_EVENTS) {
-        te = eventLoop->timeEventHead;
-        maxId = eventLoop->timeEventNextId-1;
-        while(te) {
-            long now_sec, now_ms;
-            long long id;
-
-            if (te->id > maxId) {
-                te = te->next;
-                continue;
+            fe = &eventLoop->events[fd];
+            if (fe->mask & mask & AE_WRITABLE) {
+                fe->wfileProc(eventLoop,fd,fe->clientData,AE_WRITABLE);
+                processed++;
             }
-            aeGetTime(&now_sec, &now_ms);
-            if (now_sec > te->when_sec ||
-                (now_sec == te->when_sec && now_ms >= te->when_ms))
-            {
-                int retval;
-
-                id = te->id;
-                retval = te->timeProc(eventLoop, id, te->clientData);
-                /* After an event is processed our time event list may
-                 * no longer be the same, so we restart from head.
-                 * Still we make sure to don't process events registered
-                 * by event handlers itself in order to don't loop forever.
-                 * To do so we saved the max ID we want to handle. */
-                if (retval != AE_NOMORE) {
-                    aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-                } else {
-                    aeDeleteTimeEvent(eventLoop, id);
-                }
-                te = eventLoop->timeEventHead;
-            } else {
-                te = te->next;
+            fe = &eventLoop->events[fd];
+            if (fe->mask & mask & AE_EXCEPTION) {
+                fe->efileProc(eventLoop,fd,fe->clientData,AE_EXCEPTION);
+                processed++;
             }
         }
     }
+    /* Check time events */
+    if (flags & AE_TIME_EVENTS)
+        processed += processTimeEvents(eventLoop);
     return processed; /* return the number of processed file/time events */
 }
 
 void aeMain(aeEventLoop *eventLoop)
 {
     eventLoop->stop = 0;
-    while (!eventLoop->stop)
+    while (!eventLoop->stop) {
+        if (eventLoop->beforesleep != NULL)
+            eventLoop->beforesleep(eventLoop);
         aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+    }
+}
+
+/* Set a function to call every time the event loop is about to block
+ * waiting for events. It can be used to perform work generated by the
+ * events just processed (i.e. flush replies) without a further trip into
+ * the polling API. */
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
+    eventLoop->beforesleep = beforesleep;
+}
+
+char *aeGetApiName(void) {
+    return aeApiName();
 }
@@ -7,40 +7,67 @@ struct aeEventLoop;
 typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
+typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
 
-/* File event structure */
+/* File event structure. There is one for every file descriptor, stored
+ * in the eventLoop->events table indexed by fd. The client data and the
+ * finalizer are shared by all the events registered for the same fd, the
+ * finalizer is called when the last event of the fd is deleted. */
 typedef struct aeFileEvent {
-    int fd;
-    int mask; /* one of AE_(READABLE|WRITABLE|EXCEPTION) */
-    aeFileProc *fileProc;
+    int mask; /* one or more of AE_(READABLE|WRITABLE|EXCEPTION) */
+    aeFileProc *rfileProc;
+    aeFileProc *wfileProc;
+    aeFileProc *efileProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeFileEvent *next;
 } aeFileEvent;
 
-/* Time event structure */
+/* Time event structure. Time events are kept in a binary min-heap ordered
+ * by 'when', so the nearest timer is always at eventLoop->timeEvents[0]. */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* monotonic time in microseconds */
+    int heapidx; /* position in the eventLoop->timeEvents heap */
+    struct aeTimeEvent *next; /* in the list of the skipped events */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *next;
 } aeTimeEvent;
 
+/* A fired event, as reported by the polling backend */
+typedef struct aeFiredEvent {
+    int fd;
+    int mask;
+} aeFiredEvent;
+
 /* State of an event based program */
 typedef struct aeEventLoop {
+    int maxfd;   /* highest file descriptor currently registered */
+    int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
-    aeFileEvent *fileEventHead;
-    aeTimeEvent *timeEventHead;
+    aeFileEvent *events; /* Registered events, indexed by fd */
+    aeFiredEvent *fired; /* Fired events */
+    aeTimeEvent **timeEvents; /* Min-heap of time events */
+    int timeEventsLen; /* Number of time events in the heap */
+    int timeEventsSize; /* Allocated slots of the heap */
+    aeTimeEvent *timeEventsSkipped; /* Removed from the heap while time
+                                       events are processed, see
+                                       processTimeEvents() */
+    int timeEventsSkippedLen;
+    aeTimeEvent *timeEventRunning; /* Time event whose handler is running */
+    int timeEventRunningDeleted; /* It was deleted by its own handler */
     int stop;
+    aeBeforeSleepProc *beforesleep; /* Called before blocking for events */
+    void *apidata; /* This is used for polling API specific data */
 } aeEventLoop;
 
 /* Defines */
 #define AE_OK 0
 #define AE_ERR -1
 
+#define AE_SETSIZE 1024 /* Initial setsize, grown on demand */
+
+#define AE_NONE 0
 #define AE_READABLE 1
 #define AE_WRITABLE 2
 #define AE_EXCEPTION 4
@@ -63,11 +90,14 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
+int aeGetFileEvents(aeEventLoop *eventLoop, int fd);
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 void aeMain(aeEventLoop *eventLoop);
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+char *aeGetApiName(void);
 
 #endif
@@ -0,0 +1,443 @@
+/* Linux io_uring(7) based ae.c module
+ * Copyrights (C) 2009 Salvatore Sanfilippo antirez at gmail dot com
+ * All Rights Reserved
+ *
+ * This software is released under the GPL version 2 license
+ *
+ * The ae API is readiness based: the file event handlers perform the
+ * read(2) and write(2) calls themselves. So this module uses io_uring as a
+ * poller, with one one-shot IORING_OP_POLL_ADD request in flight for every
+ * registered fd. One-shot polls are re-armed after every completion, this
+ * way we get the same level triggered semantic of select and epoll (a
+ * handler is free to leave data in the socket buffer).
+ *
+ * The win compared to epoll is that changes to the set of monitored events
+ * don't cost a syscall: aeApiAddEvent() and aeApiDelEvent() just mark the fd
+ * as dirty, and the resulting poll requests (together with the re-arm of
+ * the polls that fired in the previous iteration) are queued and submitted
+ * by the same io_uring_enter(2) call that waits for the completions.
+ *
+ * liburing is not required, the rings are set up by hand.
+ *
+ * When io_uring can't be used (kernel too old, or io_uring_setup(2) denied
+ * by a seccomp filter) the epoll module, compiled in as well, is used. */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#define AE_URING_ENTRIES 1024
+/* Every fd has a poll request in flight, and replacing it can produce up
+ * to three completions (canceled poll, remove, new poll). Ask for the
+ * largest completion queue the kernel allows: with more fds than that,
+ * the overflows are handled in aeApiPoll(). */
+#define AE_URING_CQ_ENTRIES 65536
+#define AE_URING_IGNORE ((uint64_t)-1) /* user_data of timeouts/removes */
+
+/* The epoll module, renamed, to fall back to it at runtime */
+#define aeApiState aeEpollState
+#define aeApiCreate aeEpollCreate
+#define aeApiResize aeEpollResize
+#define aeApiFree aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiPoll aeEpollPoll
+#define aeApiName aeEpollName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+/* Set by the first event loop created: -1 not known yet, 1 if io_uring is
+ * used, 0 if io_uring is not available and epoll is used instead. */
+static int aeUringAvailable = -1;
+
+typedef struct aeUringFd {
+    int armed;      /* AE mask of the poll request in flight, or AE_NONE */
+    int stale;      /* The poll in flight may refer to a closed fd */
+    int dirty;      /* Already in the dirty list */
+    unsigned gen;   /* Generation of the poll request in flight */
+} aeUringFd;
+
+typedef struct aeApiState {
+    int ringfd;
+    /* Submission queue */
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray, *sqflags;
+    unsigned sqentries;
+    struct io_uring_sqe *sqes;
+    /* Completion queue */
+    unsigned *cqhead, *cqtail, *cqmask, *cqoverflow;
+    unsigned cqdropped;     /* Value of *cqoverflow already handled */
+    int nodrop;             /* IORING_FEAT_NODROP: overflows are kept */
+    struct io_uring_cqe *cqes;
+    /* mmap()ed regions */
+    void *sqring, *cqring;
+    size_t sqringsize, cqringsize, sqessize;
+    /* Per fd state, and list of fds whose poll request must be updated */
+    aeUringFd *fds;
+    int *dirty;
+    int numdirty;
+    struct __kernel_timespec ts; /* Must be valid until submission */
+} aeApiState;
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringEnter(int fd, unsigned tosubmit, unsigned mincomplete,
+        unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete,
+            flags, NULL, _NSIG/8);
+}
+
+static void aeApiFreeRings(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes,state->sqessize);
+    if (state->cqring && state->cqring != state->sqring)
+        munmap(state->cqring,state->cqringsize);
+    if (state->sqring) munmap(state->sqring,state->sqringsize);
+    if (state->ringfd != -1) close(state->ringfd);
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state;
+    struct io_uring_params p;
+    char *sq, *cq;
+    int j;
+
+    if (aeUringAvailable == 0) return aeEpollCreate(eventLoop);
+    if ((state = calloc(1,sizeof(aeApiState))) == NULL) return -1;
+    state->ringfd = -1;
+    state->fds = malloc(sizeof(aeUringFd)*eventLoop->setsize);
+    state->dirty = malloc(sizeof(int)*eventLoop->setsize);
+    if (!state->fds || !state->dirty) goto err;
+    for (j = 0; j < eventLoop->setsize; j++)
+        memset(&state->fds[j],0,sizeof(aeUringFd));
+
+    memset(&p,0,sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_CLAMP;
+    p.cq_entries = AE_URING_CQ_ENTRIES;
+    state->ringfd = aeUringSetup(AE_URING_ENTRIES,&p);
+    if (state->ringfd == -1 && errno == EINVAL) {
+        /* Kernels before 5.5 don't know about IORING_SETUP_CQSIZE */
+        memset(&p,0,sizeof(p));
+        state->ringfd = aeUringSetup(AE_URING_ENTRIES,&p);
+    }
+    if (state->ringfd == -1) {
+        if (aeUringAvailable == -1) {
+            /* ENOSYS, or EPERM under seccomp: use epoll instead */
+            aeUringAvailable = 0;
+            free(state->fds);
+            free(state->dirty);
+            free(state);
+            return aeEpollCreate(eventLoop);
+        }
+        goto err;
+    }
+
+    state->sqringsize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cqringsize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqringsize > state->sqringsize)
+            state->sqringsize = state->cqringsize;
+        state->cqringsize = state->sqringsize;
+    }
+    state->sqring = mmap(NULL,state->sqringsize,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQ_RING);
+    if (state->sqring == MAP_FAILED) {
+        state->sqring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cqring = state->sqring;
+    } else {
+        state->cqring = mmap(NULL,state->cqringsize,PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_CQ_RING);
+        if (state->cqring == MAP_FAILED) {
+            state->cqring = NULL;
+            goto err;
+        }
+    }
+    state->sqessize = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL,state->sqessize,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    sq = state->sqring;
+    state->sqhead = (unsigned*)(sq+p.sq_off.head);
+    state->sqtail = (unsigned*)(sq+p.sq_off.tail);
+    state->sqmask = (unsigned*)(sq+p.sq_off.ring_mask);
+    state->sqarray = (unsigned*)(sq+p.sq_off.array);
+    state->sqflags = (unsigned*)(sq+p.sq_off.flags);
+    state->sqentries = p.sq_entries;
+    cq = state->cqring;
+    state->cqhead = (unsigned*)(cq+p.cq_off.head);
+    state->cqtail = (unsigned*)(cq+p.cq_off.tail);
+    state->cqmask = (unsigned*)(cq+p.cq_off.ring_mask);
+    state->cqoverflow = (unsigned*)(cq+p.cq_off.overflow);
+    state->cqdropped = *state->cqoverflow;
+    state->nodrop = (p.features & IORING_FEAT_NODROP) != 0;
+    state->cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+    eventLoop->apidata = state;
+    aeUringAvailable = 1;
+    return 0;
+
+err:
+    aeApiFreeRings(state);
+    free(state->fds);
+    free(state->dirty);
+    free(state);
+    return -1;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    aeUringFd *fds;
+    int *dirty, j;
+
+    if (aeUringAvailable == 0) return aeEpollResize(eventLoop,setsize);
+    fds = realloc(state->fds,sizeof(aeUringFd)*setsize);
+    if (!fds) return -1;
+    state->fds = fds;
+    for (j = eventLoop->setsize; j < setsize; j++)
+        memset(&state->fds[j],0,sizeof(aeUringFd));
+    dirty = realloc(state->dirty,sizeof(int)*setsize);
+    if (!dirty) return -1;
+    state->dirty = dirty;
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (aeUringAvailable == 0) {
+        aeEpollFree(eventLoop);
+        return;
+    }
+    aeApiFreeRings(state);
+    free(state->fds);
+    free(state->dirty);
+    free(state);
+}
+
+/* Return a zeroed submission queue entry. If the ring is full the queued
+ * entries are submitted to make room. */
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    unsigned tail = *state->sqtail;
+    unsigned head = __atomic_load_n(state->sqhead,__ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (tail-head == state->sqentries) {
+        aeUringEnter(state->ringfd,tail-head,0,0);
+        head = __atomic_load_n(state->sqhead,__ATOMIC_ACQUIRE);
+        if (tail-head == state->sqentries) return NULL;
+    }
+    sqe = &state->sqes[tail & *state->sqmask];
+    memset(sqe,0,sizeof(*sqe));
+    return sqe;
+}
+
+/* Make the entry returned by aeUringGetSqe() visible to the kernel. */
+static void aeUringQueueSqe(aeApiState *state, struct io_uring_sqe *sqe) {
+    unsigned tail = *state->sqtail;
+    unsigned idx = sqe - state->sqes;
+
+    state->sqarray[tail & *state->sqmask] = idx;
+    __atomic_store_n(state->sqtail,tail+1,__ATOMIC_RELEASE);
+}
+
+static uint64_t aeUringUserData(aeUringFd *ufd, int fd) {
+    return ((uint64_t)ufd->gen << 32) | (unsigned) fd;
+}
+
+static void aeUringMarkDirty(aeApiState *state, int fd) {
+    if (state->fds[fd].dirty) return;
+    state->fds[fd].dirty = 1;
+    state->dirty[state->numdirty++] = fd;
+}
+
+/* Bring the poll request in flight for 'fd' in sync with the registered
+ * events. A request monitoring the wrong events is removed (bumping the
+ * generation so that a late completion will be ignored), then a new one
+ * is queued if there is still something to monitor. */
+static void aeUringUpdateFd(aeEventLoop *eventLoop, int fd) {
+    aeApiState *state = eventLoop->apidata;
+    aeUringFd *ufd = &state->fds[fd];
+    int mask = eventLoop->events[fd].mask;
+    struct io_uring_sqe *sqe;
+
+    ufd->dirty = 0;
+    if (ufd->armed != AE_NONE && (ufd->stale || ufd->armed != mask)) {
+        if ((sqe = aeUringGetSqe(state)) == NULL) goto retry;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = aeUringUserData(ufd,fd);
+        sqe->user_data = AE_URING_IGNORE;
+        aeUringQueueSqe(state,sqe);
+        ufd->gen++;
+        ufd->armed = AE_NONE;
+    }
+    ufd->stale = 0;
+    if (ufd->armed == AE_NONE && mask != AE_NONE) {
+        if ((sqe = aeUringGetSqe(state)) == NULL) goto retry;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        if (mask & AE_READABLE) sqe->poll32_events |= POLLIN;
+        if (mask & AE_WRITABLE) sqe->poll32_events |= POLLOUT;
+        if (mask & AE_EXCEPTION) sqe->poll32_events |= POLLPRI;
+        sqe->user_data = aeUringUserData(ufd,fd);
+        aeUringQueueSqe(state,sqe);
+        ufd->armed = mask;
+    }
+    return;
+
+retry:
+    /* The kernel did not accept our entries, try again next time */
+    state->dirty[state->numdirty++] = fd;
+    ufd->dirty = 1;
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    if (aeUringAvailable == 0) return aeEpollAddEvent(eventLoop,fd,mask);
+    aeUringMarkDirty(eventLoop->apidata,fd);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (aeUringAvailable == 0) {
+        aeEpollDelEvent(eventLoop,fd,delmask);
+        return;
+    }
+    /* The fd is likely to be closed soon after the last event is deleted,
+     * and a new one with the same number may be registered before we get
+     * the chance to update the poll request: make sure it is replaced. */
+    if ((eventLoop->events[fd].mask & ~delmask) == AE_NONE)
+        state->fds[fd].stale = 1;
+    aeUringMarkDirty(state,fd);
+}
+
+/* Completions were dropped because the completion queue was full. There
+ * is no way to know which ones, so every poll request in flight is
+ * replaced: the new requests complete at once for the fds that are ready,
+ * and the lost wake-ups are delivered. */
+static void aeUringResync(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    int fd;
+
+    for (fd = 0; fd <= eventLoop->maxfd; fd++) {
+        if (state->fds[fd].armed == AE_NONE) continue;
+        state->fds[fd].stale = 1;
+        aeUringMarkDirty(state,fd);
+    }
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    unsigned head, tail, tosubmit, wait = 1;
+    int j, numdirty, numevents = 0;
+
+    if (aeUringAvailable == 0) return aeEpollPoll(eventLoop,tvp);
+
+    /* Queue the poll requests changed since the last call */
+    numdirty = state->numdirty;
+    state->numdirty = 0;
+    for (j = 0; j < numdirty; j++)
+        aeUringUpdateFd(eventLoop,state->dirty[j]);
+
+    if (tvp) {
+        if (tvp->tv_sec == 0 && tvp->tv_usec == 0) {
+            wait = 0;
+        } else {
+            struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+            /* The timeout completes as soon as any other request does,
+             * so it never outlives this call by much. */
+            if (sqe) {
+                state->ts.tv_sec = tvp->tv_sec;
+                state->ts.tv_nsec = (long long)tvp->tv_usec*1000;
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uintptr_t) &state->ts;
+                sqe->len = 1;
+                sqe->off = 1;
+                sqe->user_data = AE_URING_IGNORE;
+                aeUringQueueSqe(state,sqe);
+            } else {
+                wait = 0;
+            }
+        }
+    }
+
+    /* Submit everything and wait in a single syscall */
+    tosubmit = *state->sqtail - __atomic_load_n(state->sqhead,__ATOMIC_ACQUIRE);
+    head = *state->cqhead;
+    tail = __atomic_load_n(state->cqtail,__ATOMIC_ACQUIRE);
+    if (tosubmit || (wait && head == tail))
+        aeUringEnter(state->ringfd,tosubmit,wait,IORING_ENTER_GETEVENTS);
+
+again:
+    tail = __atomic_load_n(state->cqtail,__ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqmask];
+        int fd = (int)(cqe->user_data & 0xffffffff), mask = 0;
+        aeUringFd *ufd;
+
+        if (cqe->user_data == AE_URING_IGNORE) continue;
+        if (fd >= eventLoop->setsize) continue;
+        ufd = &state->fds[fd];
+        if ((unsigned)(cqe->user_data >> 32) != ufd->gen ||
+            ufd->armed == AE_NONE) continue; /* Stale completion */
+
+        /* One-shot poll: it must be armed again. */
+        if (cqe->res < 0) {
+            /* Report the error to the handlers, the read or write will
+             * notice it. */
+            mask = ufd->armed & (AE_READABLE|AE_WRITABLE);
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLPRI) mask |= AE_EXCEPTION;
+            if (cqe->res & (POLLERR|POLLHUP))
+                mask |= ufd->armed & (AE_READABLE|AE_WRITABLE);
+        }
+        ufd->armed = AE_NONE;
+        aeUringMarkDirty(state,fd);
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cqhead,head,__ATOMIC_RELEASE);
+
+    /* With IORING_FEAT_NODROP the completions that didn't fit are kept by
+     * the kernel, and moved to the ring as soon as we ask for events. */
+    if (state->nodrop &&
+        (__atomic_load_n(state->sqflags,__ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+    {
+        aeUringEnter(state->ringfd,0,0,IORING_ENTER_GETEVENTS);
+        goto again;
+    }
+    if (*state->cqoverflow != state->cqdropped) {
+        state->cqdropped = *state->cqoverflow;
+        aeUringResync(eventLoop);
+    }
+    return numevents;
+}
+
+static char *aeApiName(void) {
+    return aeUringAvailable == 0 ? aeEpollName() : "io_uring";
+}
@@ -0,0 +1,16 @@
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+/* Test for the polling API available on this system. ae.c will include
+ * the select(2) based implementation if nothing better is found. */
+#ifdef __linux__
+#define HAVE_EPOLL 1
+#endif
+
+/* The io_uring backend needs Linux 5.4 or newer, so it is not the default.
+ * Build with 'make USE_IO_URING=yes' to use it instead of epoll. */
+#if defined(__linux__) && defined(USE_IO_URING)
+#define HAVE_IO_URING 1
+#endif
+
+#endif
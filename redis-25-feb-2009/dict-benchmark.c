@@ -0,0 +1,154 @@
+/* Hash table micro benchmark - Copyright (C) 2009 Salvatore Sanfilippo
+ * antirez at gmail dot com
+ *
+ * Measures insert and lookup throughput and memory used per key of the
+ * dict.c hash table, using the same kind of keys (sds strings) of the
+ * Redis key space. Usage:
+ *
+ *   ./dict-benchmark [number of keys] [-stats] [-oa] [-generic]
+ *
+ * With -oa the dictionary uses open addressing (dictCreateOpenAddressing())
+ * instead of chaining. With -generic the keys are hashed and compared
+ * calling the dictType methods, instead of the DICT_TYPE_SDS_KEYS
+ * specialized code. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "dict.h"
+#include "sds.h"
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+static uint64_t benchHashFunction(const void *key) {
+    return dictGenHashFunction(key, sdslen((sds)key));
+}
+
+static int benchKeyCompare(void *privdata, const void *key1,
+        const void *key2)
+{
+    int l1,l2;
+    DICT_NOTUSED(privdata);
+
+    l1 = sdslen((sds)key1);
+    l2 = sdslen((sds)key2);
+    if (l1 != l2) return 0;
+    return memcmp(key1, key2, l1) == 0;
+}
+
+static void benchKeyDestructor(void *privdata, void *key) {
+    DICT_NOTUSED(privdata);
+    sdsfree(key);
+}
+
+/* Same layout of the Redis key space: sds keys, opaque values */
+static dictType benchDictType = {
+    benchHashFunction,      /* hash function */
+    NULL,                   /* key dup */
+    NULL,                   /* val dup */
+    benchKeyCompare,        /* key compare */
+    benchKeyDestructor,     /* key destructor */
+    NULL,                   /* val destructor */
+    NULL,                   /* key embedded len */
+    NULL,                   /* key embed */
+    DICT_TYPE_SDS_KEYS      /* flags */
+};
+
+static sds benchKey(long j) {
+    return sdscatprintf(sdsempty(),"key:%ld",j);
+}
+
+static void report(char *title, long ops, long long elapsed) {
+    printf("%-24s %ld ops in %lld ms, %.2f Mops/sec\n", title, ops,
+        elapsed/1000, elapsed ? (float)ops/elapsed : 0);
+}
+
+int main(int argc, char **argv) {
+    long j, count = 1000000, found = 0;
+    long long start, keybytes = 0, tablebytes;
+    int stats = 0, oa = 0;
+    dict *d;
+    sds *keys;
+
+    for (j = 1; j < argc; j++) {
+        if (!strcmp(argv[j],"-stats"))
+            stats = 1;
+        else if (!strcmp(argv[j],"-oa"))
+            oa = 1;
+        else if (!strcmp(argv[j],"-generic"))
+            benchDictType.flags &= ~DICT_TYPE_SDS_KEYS;
+        else
+            count = strtol(argv[j],NULL,10);
+    }
+    if (count <= 0) {
+        fprintf(stderr,"Usage: dict-benchmark [number of keys] [-stats] [-oa] [-generic]\n");
+        exit(1);
+    }
+
+    /* Create the keys in advance so that only the hash table is timed */
+    keys = malloc(sizeof(sds)*count);
+    for (j = 0; j < count; j++) {
+        keys[j] = benchKey(j);
+        keybytes += sizeof(struct sdshdr)+sdslen(keys[j])+1;
+    }
+
+    d = oa ? dictCreateOpenAddressing(&benchDictType,NULL) :
+             dictCreate(&benchDictType,NULL);
+    printf("%s hash tables, %ld keys\n",
+        dictIsOpenAddressing(d) ? "Open addressing" : "Chaining", count);
+    start = ustime();
+    for (j = 0; j < count; j++)
+        dictAdd(d,keys[j],NULL);
+    report("Insert",count,ustime()-start);
+
+    /* Random lookups of existing keys, with sds keys not shared with the
+     * dictionary so that the key compare always touches two strings. */
+    srandom(1234);
+    start = ustime();
+    for (j = 0; j < count; j++) {
+        sds key = benchKey(random() % count);
+
+        if (dictFind(d,key)) found++;
+        sdsfree(key);
+    }
+    report("Lookup existing (+sds)",count,ustime()-start);
+    if (found != count) {
+        fprintf(stderr,"Error: %ld keys not found\n", count-found);
+        exit(1);
+    }
+
+    start = ustime();
+    for (j = 0; j < count; j++)
+        dictFind(d,keys[random() % count]);
+    report("Lookup existing",count,ustime()-start);
+
+    start = ustime();
+    for (j = 0; j < count; j++) {
+        sds key = benchKey(count+j);
+
+        if (dictFind(d,key)) found++;
+        sdsfree(key);
+    }
+    report("Lookup missing (+sds)",count,ustime()-start);
+
+    /* Memory used, malloc() overhead excluded */
+    while(dictRehash(d,100));
+    tablebytes = dictGetSlotBytes(d)*dictGetHashTableSize(d);
+    printf("Memory: %.2f bytes/key (table %.2f, entries %.2f, keys %.2f)\n",
+        (float)(tablebytes+dictGetEntryBytes(d)*count+keybytes)/count,
+        (float)tablebytes/count, (float)dictGetEntryBytes(d),
+        (float)keybytes/count);
+    if (stats) dictPrintStats(d);
+
+    start = ustime();
+    dictRelease(d);
+    report("Release",count,ustime()-start);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,288 @@
+/* Hash table unit tests - Copyright (C) 2009 Salvatore Sanfilippo
+ * antirez at gmail dot com
+ *
+ * Tests the parts of dict.c that only matter for huge tables and that the
+ * Redis tests can't reach. dict.c is included here, so that the private
+ * functions can be called, with a smaller DICT_HASH_TAG_MASK: entries
+ * cache just 8 bits of the hash, and tables of more than 256 buckets run
+ * the code written for tables of more than 2^32 buckets. Usage:
+ *
+ *   make dict-test && ./dict-test
+ *
+ * Every test runs with the chained and with the open addressing hash
+ * tables. The exit status is 1 if some test failed.
+ *
+ * 'make dict-test-huge' builds the same file with DICT_TEST_HUGE defined
+ * and the real DICT_HASH_TAG_MASK: it fills a dictionary with more than
+ * 2^32 keys for real. This needs about 200GB of memory and a long time,
+ * so it is only run on demand:
+ *
+ *   ./dict-test-huge [-oa] [number of keys]
+ *
+ * A smaller number of keys checks the test itself on a normal machine. */
+
+#ifndef DICT_TEST_HUGE
+#define DICT_HASH_TAG_MASK 0xffUL
+#endif
+#include "dict.c"
+#include <sys/mman.h>
+
+static int passed = 0, failed = 0;
+
+static void test(char *name, int ok) {
+    printf("%-70s %s\n", name, ok ? "PASSED" : "!! ERROR");
+    if (ok) passed++; else failed++;
+}
+
+/* Keys are the integers 1...N, hashes use all the 64 bits */
+static unsigned long hashcalls = 0;
+
+static uint64_t testHashFunction(const void *key) {
+    uint64_t h = (uintptr_t)key;
+
+    hashcalls++;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+static dictType testDictType = {
+    testHashFunction,       /* hash function */
+    NULL,                   /* key dup */
+    NULL,                   /* val dup */
+    NULL,                   /* key compare: same pointer */
+    NULL,                   /* key destructor */
+    NULL,                   /* val destructor */
+    NULL,                   /* key embedded len */
+    NULL,                   /* key embed */
+    0                       /* flags */
+};
+
+static dict *testCreate(int oa) {
+    return oa ? dictCreateOpenAddressing(&testDictType,NULL) :
+                dictCreate(&testDictType,NULL);
+}
+
+static void testNextPower(void) {
+    unsigned long top = LONG_MAX+1LU; /* the biggest table */
+
+    test("_dictNextPower() of small sizes",
+        _dictNextPower(0) == DICT_HT_INITIAL_SIZE &&
+        _dictNextPower(DICT_HT_INITIAL_SIZE+1) == DICT_HT_INITIAL_SIZE*2);
+    test("_dictNextPower() of a power of two near the cap",
+        _dictNextPower(top/2) == top/2 && _dictNextPower(top) == top);
+    test("_dictNextPower() of sizes just under the cap",
+        _dictNextPower(top/2+1) == top && _dictNextPower(LONG_MAX) == top);
+    test("_dictNextPower() of sizes over the cap",
+        _dictNextPower(top+1) == top && _dictNextPower(ULONG_MAX) == top);
+}
+
+static unsigned long scanned;
+
+static void scanCallback(void *privdata, const dictEntry *de) {
+    DICT_NOTUSED(privdata);
+    DICT_NOTUSED(de);
+    scanned++;
+}
+
+#ifndef DICT_TEST_HUGE
+/* Tables bigger than the hash bits cached in the entries: rehashing has to
+ * compute the hash of the keys again, and the keys must still be found. */
+static void testRehashBigTables(int oa) {
+    dict *d = testCreate(oa);
+    unsigned long j, found = 0, count = 100000;
+    unsigned long v = 0;
+    int ok;
+
+    hashcalls = 0;
+    scanned = 0;
+    for (j = 1; j <= 100; j++) dictAdd(d,(void*)j,NULL);
+    test("Rehashing small tables uses the cached hash",
+        hashcalls == 100 && d->ht[0].sizemask <= DICT_HASH_TAG_MASK);
+
+    for (j = 101; j <= count; j++) dictAdd(d,(void*)j,NULL);
+    test("Rehashing big tables computes the hash again",
+        hashcalls > count && d->ht[0].sizemask > DICT_HASH_TAG_MASK);
+
+    /* Scan in the middle of a rehashing, too */
+    while(dictRehash(d,100));
+    dictExpand(d,count*4);
+    dictRehash(d,100);
+    ok = dictIsRehashing(d);
+    do {
+        v = dictScan(d,v,scanCallback,NULL);
+    } while(v);
+    for (j = 1; j <= count; j++) {
+        dictEntry *de = dictFind(d,(void*)j);
+        if (de && dictGetEntryKey(de) == (void*)j) found++;
+    }
+    test("Keys of big tables are found, and scanned, while rehashing",
+        ok && found == count && scanned >= count);
+
+    while(dictRehash(d,100));
+    for (j = 1, found = 0; j <= count; j++)
+        if (dictFind(d,(void*)j)) found++;
+    test("Keys of big tables are found after the rehashing",
+        found == count && dictGetHashTableUsed(d) == count);
+    dictRelease(d);
+}
+
+#endif
+
+/* Iterate a table of 2^32 slots: only the pages of the slots that are
+ * accessed are actually allocated. The iterator is moved forward by hand
+ * to the slots before the entries, instead of visiting all the slots. */
+static void testIteratorBigIndex(int oa) {
+    dict *d = testCreate(oa);
+    unsigned long size = 1UL << 32, j;
+    unsigned long idx[3] = {0, (unsigned long)INT_MAX+1, (1UL << 32)-1};
+    dictEntry entries[3], *de;
+    dictIterator *iter;
+    void *mem;
+    int ok = 1;
+
+    if (sizeof(long) < 8) {
+        printf("%-70s skipped (32 bit)\n", "Iterator indexes above INT_MAX");
+        dictRelease(d);
+        return;
+    }
+    mem = mmap(NULL,size*dictGetSlotBytes(d),PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if (mem == MAP_FAILED) {
+        printf("%-70s skipped (mmap)\n", "Iterator indexes above INT_MAX");
+        dictRelease(d);
+        return;
+    }
+    d->ht[0].table = mem;
+    d->ht[0].size = size;
+    d->ht[0].sizemask = size-1;
+    if (oa) d->ht[0].ctrl = (unsigned char*)(d->ht[0].table+size);
+    for (j = 0; j < 3; j++) {
+        memset(&entries[j],0,sizeof(dictEntry));
+        entries[j].key = (void*)(j+1);
+        d->ht[0].table[idx[j]] = &entries[j];
+        if (oa) d->ht[0].ctrl[idx[j]] = 0; /* used */
+        d->ht[0].used++;
+    }
+
+    iter = dictGetIterator(d);
+    for (j = 0; j < 3; j++) {
+        if (j) iter->index = idx[j]-1;
+        de = dictNext(iter);
+        if (de != &entries[j] || (unsigned long)iter->index != idx[j]) ok = 0;
+    }
+    if (dictNext(iter) != NULL) ok = 0;
+    dictReleaseIterator(iter);
+    test("Iterator indexes above INT_MAX", ok && d->iterators == 0);
+
+    munmap(mem,size*dictGetSlotBytes(d));
+    _dictReset(&d->ht[0]);
+    dictRelease(d);
+}
+
+#ifdef DICT_TEST_HUGE
+/* Add the keys 1...count, check that they are all there, then delete most
+ * of them and check that the table shrinks. */
+static void testHuge(int oa, unsigned long count) {
+    dict *d = testCreate(oa);
+    unsigned long j, found, size, fill;
+    unsigned long v = 0;
+    dictIterator *iter;
+    dictEntry *de;
+    long long start = timeInMilliseconds();
+    int ok = 1;
+
+    for (j = 1; j <= count; j++) {
+        if (dictAdd(d,(void*)j,NULL) != DICT_OK) ok = 0;
+        if ((j & 0xfffffff) == 0)
+            fprintf(stderr,"%lu keys added\n", j);
+    }
+    while(dictRehash(d,1000));
+    printf("%lu keys added in %lld seconds\n", count,
+        (timeInMilliseconds()-start)/1000);
+    size = d->ht[0].size;
+    test("Every add succeeds", ok && dictGetHashTableUsed(d) == count);
+    fill = dictGetHashTableUsed(d)*100/size;
+    printf("Table size %lu, %lu%% full\n", size, fill);
+    test("The table is big enough, and not too big", fill > 25 && fill <= 100);
+    if (count > 1UL<<32)
+        test("The table has more than 2^32 buckets", size > 1UL<<32);
+    else
+        printf("%-70s skipped (%lu keys)\n",
+            "The table has more than 2^32 buckets", count);
+
+    for (j = 1, found = 0; j <= count; j++) {
+        de = dictFind(d,(void*)j);
+        if (de && dictGetEntryKey(de) == (void*)j) found++;
+    }
+    for (j = count+1; j <= count+1000; j++)
+        if (dictFind(d,(void*)j)) found = 0;
+    test("Every key is found, and missing keys are not", found == count);
+
+    found = 0;
+    iter = dictGetIterator(d);
+    while((de = dictNext(iter)) != NULL)
+        if ((unsigned long)dictGetEntryKey(de) <= count) found++;
+    dictReleaseIterator(iter);
+    test("The iterator returns every key", found == count);
+
+    scanned = 0;
+    do {
+        v = dictScan(d,v,scanCallback,NULL);
+    } while(v);
+    test("dictScan() returns every key", scanned >= count);
+
+    for (j = count/8+1; j <= count; j++)
+        if (dictDelete(d,(void*)j) != DICT_OK) ok = 0;
+    dictResize(d);
+    while(dictRehash(d,1000));
+    for (j = 1, found = 0; j <= count/8; j++)
+        if (dictFind(d,(void*)j)) found++;
+    test("Deleting 7/8 of the keys shrinks the table",
+        ok && d->ht[0].size < size && found == count/8 &&
+        dictGetHashTableUsed(d) == count/8);
+    dictRelease(d);
+}
+
+int main(int argc, char **argv) {
+    unsigned long count = (1UL<<32)+1000;
+    int j, oa = 0;
+
+    for (j = 1; j < argc; j++) {
+        if (!strcmp(argv[j],"-oa"))
+            oa = 1;
+        else
+            count = strtoul(argv[j],NULL,10);
+    }
+    if (sizeof(long) < 8 || count == 0) {
+        fprintf(stderr,"Usage: dict-test-huge [-oa] [number of keys] "
+                       "(64 bit only)\n");
+        return 1;
+    }
+    printf("Testing the %s hash tables with %lu keys\n",
+        oa ? "open addressing" : "chained", count);
+    testNextPower();
+    testIteratorBigIndex(oa);
+    testHuge(oa,count);
+    printf("\n%d tests, %d passed, %d failed\n", passed+failed, passed,
+        failed);
+    return failed ? 1 : 0;
+}
+#else
+int main(void) {
+    int oa;
+
+    testNextPower();
+    for (oa = 0; oa <= 1; oa++) {
+        printf("\nTesting the %s hash tables\n",
+            oa ? "open addressing" : "chained");
+        testRehashBigTables(oa);
+        testIteratorBigIndex(oa);
+    }
+    printf("\n%d tests, %d passed, %d failed\n", passed+failed, passed,
+        failed);
+    return failed ? 1 : 0;
+}
+#endif
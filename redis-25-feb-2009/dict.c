@@ -4,7 +4,8 @@
  * This file implements in memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining.
+ * chaining. The dictionaries created with dictCreateOpenAddressing() use
+ * open addressing instead, see dict_oa.c.
  */
 
 #include <stdio.h>
@@ -12,7 +13,13 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <limits.h>
 #include "dict.h"
+#include "slab.h"
+#include "sds.h"
 
 /* ---------------------------- Utility funcitons --------------------------- */
 
@@ -29,7 +36,7 @@ static void _dictPanic(const char *fmt, ...)
 
 /* ------------------------- Heap Management Wrappers------------------------ */
 
-static void *_dictAlloc(int size)
+static void *_dictAlloc(size_t size)
 {
     void *p = malloc(size);
     if (p == NULL)
@@ -41,12 +48,115 @@ static void _dictFree(void *ptr) {
     free(ptr);
 }
 
+/* Entries are small and allocated and released all the time, so they
+ * come from the slab allocator. Their size depends on the dict (open
+ * addressing entries have no 'next' pointer) and on the embedded key. */
+static dictEntry *_dictAllocEntry(dict *d, size_t embedlen)
+{
+    dictEntry *he = slabAlloc(dictGetEntryBytes(d)+embedlen);
+    if (he == NULL)
+        _dictPanic("Out of memory");
+    he->keyembedlen = embedlen;
+    return he;
+}
+
+static void _dictFreeEntry(dict *d, dictEntry *he) {
+    slabFree(he, dictGetEntryBytes(d)+he->keyembedlen);
+}
+
+/* ------------------------- key type specialization ------------------------ */
+
+/* The lookup and update functions take a 'sdskeys' argument that is always
+ * a constant where they are called, see for instance dictFind(). When it is
+ * true the keys are hashed, compared and freed as sds strings directly,
+ * without calling the dictType methods. Since the functions are inlined
+ * the compiler generates a version for DICT_TYPE_SDS_KEYS dictionaries
+ * with no indirect call at all, and one for all the other types. */
+#ifdef __GNUC__
+#define DICT_INLINE static inline __attribute__((always_inline))
+#else
+#define DICT_INLINE static inline
+#endif
+
+#define _dictSdsKeys(d) ((d)->type->flags & DICT_TYPE_SDS_KEYS)
+
+/* Entries cache the low 32 bits of the hash. dict-test.c defines a
+ * smaller mask to run the code for tables bigger than the cached bits. */
+#ifndef DICT_HASH_TAG_MASK
+#define DICT_HASH_TAG_MASK 0xffffffffUL
+#endif
+#define _dictHashTag(h) ((unsigned int)((h) & DICT_HASH_TAG_MASK))
+
+#ifdef __GNUC__
+#define _dictPrefetch(p) __builtin_prefetch(p)
+#else
+#define _dictPrefetch(p) ((void)(p))
+#endif
+
+#define _dictHashKey(d, key, sdskeys) \
+    ((sdskeys) ? dictGenHashFunction(key, sdsHdrLen(key)) : \
+                 dictHashKey(d, key))
+
+#define _dictCompareKeys(d, key1, key2, sdskeys) \
+    ((sdskeys) ? (sdsHdrLen(key1) == sdsHdrLen(key2) && \
+                  memcmp(key1, key2, sdsHdrLen(key1)) == 0) : \
+                 dictCompareHashKeys(d, key1, key2))
+
+#define _dictFreeEntryKey(d, entry, sdskeys) do { \
+    if (!(sdskeys)) { \
+        dictFreeEntryKey(d, entry); \
+    } else if (!(entry)->keyembedlen) { \
+        sdsfree((entry)->key); \
+    } \
+} while(0)
+
 /* -------------------------- private prototypes ---------------------------- */
 
-static int _dictExpandIfNeeded(dict *ht);
-static unsigned int _dictNextPower(unsigned int size);
-static int _dictKeyIndex(dict *ht, const void *key);
-static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static int _dictExpandIfNeeded(dict *d);
+static unsigned long _dictNextPower(unsigned long size);
+DICT_INLINE long _dictKeyIndex(dict *d, const void *key, uint64_t h,
+        dictEntry **existing, int sdskeys);
+static int _dictInit(dict *d, dictType *type, void *privDataPtr);
+static void _dictReset(dictht *ht);
+static void _dictRehashStep(dict *d);
+
+/* Allocate the entry of a new key, with a NULL value. The key is stored,
+ * or embedded in the entry if the type asks for it: embedded keys live
+ * just after the entry, so lookups find the key bytes in the same
+ * allocation. */
+DICT_INLINE dictEntry *_dictCreateEntry(dict *d, void *key, uint64_t h,
+        int sdskeys)
+{
+    size_t entrylen = dictGetEntryBytes(d), embedlen;
+    dictEntry *entry;
+
+    embedlen = d->type->keyEmbedLen ?
+        d->type->keyEmbedLen(d->privdata, key) : 0;
+    entry = _dictAllocEntry(d, embedlen);
+    entry->hash = _dictHashTag(h);
+    entry->val = NULL;
+    if (embedlen) {
+        entry->key = d->type->keyEmbed(d->privdata, (char*)entry+entrylen,
+                                       key);
+        if (sdskeys)
+            sdsfree(key);
+        else if (!d->type->keyDup && d->type->keyDestructor)
+            d->type->keyDestructor(d->privdata, key);
+    } else {
+        dictSetHashKey(d, entry, key);
+    }
+    return entry;
+}
+
+/* random() returns just 31 bits, not enough to pick a bucket in tables
+ * of more than 2^31 buckets */
+static unsigned long _dictRandom(void) {
+    return ((unsigned long)random() << 31) ^ (unsigned long)random();
+}
+
+#define DICT_STATS_VECTLEN 50
+
+#include "dict_oa.c"
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -68,13 +178,63 @@ unsigned int dictIdentityHashFunction(unsigned int key)
     return key;
 }
 
-/* Generic hash function (a popular one from Bernstein).
- * I tested a few and this was the best. */
-unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = 5381;
+static uint32_t dict_hash_function_seed = 5381;
+
+void dictSetHashFunctionSeed(uint32_t seed) {
+    dict_hash_function_seed = seed;
+}
+
+uint32_t dictGetHashFunctionSeed(void) {
+    return dict_hash_function_seed;
+}
+
+/* Generic hash function: MurmurHash64A by Austin Appleby, seeded with
+ * a per process random value so that the bucket of a given key can't be
+ * guessed by clients, and sending keys that collide is not an option.
+ * It consumes 8 bytes per step and spreads sequential keys like "key:1",
+ * "key:2", ... much better than the old hash*33+c did in the low bits. */
+uint64_t dictGenHashFunction(const unsigned char *buf, int len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = dict_hash_function_seed ^ (len * m);
+    const unsigned char *end = buf + (len & ~7);
+
+    while(buf != end) {
+        uint64_t k;
+
+        memcpy(&k,buf,sizeof(k)); /* unaligned safe, compiles to a load */
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+        buf += 8;
+    }
+
+    switch(len & 7) {
+    case 7: h ^= (uint64_t)buf[6] << 48; /* fall through */
+    case 6: h ^= (uint64_t)buf[5] << 40; /* fall through */
+    case 5: h ^= (uint64_t)buf[4] << 32; /* fall through */
+    case 4: h ^= (uint64_t)buf[3] << 24; /* fall through */
+    case 3: h ^= (uint64_t)buf[2] << 16; /* fall through */
+    case 2: h ^= (uint64_t)buf[1] << 8; /* fall through */
+    case 1: h ^= (uint64_t)buf[0];
+            h *= m;
+    };
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+/* And a case insensitive version, only used for small tables (the command
+ * table) so the byte by byte Bernstein hash is fine here. */
+unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
+    unsigned int hash = dict_hash_function_seed;
 
     while (len--)
-        hash = ((hash << 5) + hash) + (*buf++); /* hash * 33 + c */
+        hash = ((hash << 5) + hash) + (tolower(*buf++)); /* hash * 33 + c */
     return hash;
 }
 
@@ -82,182 +242,341 @@ unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
 
 /* Reset an hashtable already initialized with ht_init().
  * NOTE: This function should only called by ht_destroy(). */
-static void _dictReset(dict *ht)
+static void _dictReset(dictht *ht)
 {
     ht->table = NULL;
+    ht->ctrl = NULL;
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->deleted = 0;
 }
 
 /* Create a new hash table */
 dict *dictCreate(dictType *type,
         void *privDataPtr)
 {
-    dict *ht = _dictAlloc(sizeof(*ht));
+    dict *d = _dictAlloc(sizeof(*d));
+
+    _dictInit(d,type,privDataPtr);
+    return d;
+}
+
+/* Create a new hash table using open addressing (see dict_oa.c): entries
+ * without the 'next' pointer, and lookups that only access the entries
+ * of the keys that are likely to match */
+dict *dictCreateOpenAddressing(dictType *type,
+        void *privDataPtr)
+{
+    dict *d = dictCreate(type,privDataPtr);
 
-    _dictInit(ht,type,privDataPtr);
-    return ht;
+    d->openaddressing = 1;
+    return d;
 }
 
 /* Initialize the hash table */
-int _dictInit(dict *ht, dictType *type,
+int _dictInit(dict *d, dictType *type,
         void *privDataPtr)
 {
-    _dictReset(ht);
-    ht->type = type;
-    ht->privdata = privDataPtr;
+    _dictReset(&d->ht[0]);
+    _dictReset(&d->ht[1]);
+    d->type = type;
+    d->privdata = privDataPtr;
+    d->rehashidx = -1;
+    d->iterators = 0;
+    d->openaddressing = 0;
     return DICT_OK;
 }
 
 /* Resize the table to the minimal size that contains all the elements,
  * but with the invariant of a USER/BUCKETS ration near to <= 1 */
-int dictResize(dict *ht)
+int dictResize(dict *d)
 {
-    int minimal = ht->used;
+    unsigned long minimal;
 
+    if (dictIsRehashing(d)) return DICT_ERR;
+    minimal = d->ht[0].used;
     if (minimal < DICT_HT_INITIAL_SIZE)
         minimal = DICT_HT_INITIAL_SIZE;
-    return dictExpand(ht, minimal);
+    return dictExpand(d, minimal);
 }
 
-/* Expand or create the hashtable */
-int dictExpand(dict *ht, unsigned int size)
+/* Expand or create the hashtable. The elements are not moved here: the
+ * new table becomes d->ht[1] and the elements are migrated incrementally
+ * by dictRehash(). */
+int dictExpand(dict *d, unsigned long size)
 {
-    dict n; /* the new hashtable */
-    unsigned int realsize = _dictNextPower(size), i;
+    dictht n; /* the new hashtable */
+    unsigned long realsize = _dictNextPower(size);
+
+    if (d->openaddressing) return _dictOaExpand(d,size);
 
     /* the size is invalid if it is smaller than the number of
-     * elements already inside the hashtable */
-    if (ht->used > size)
+     * elements already inside the hashtable, or if we are already
+     * rehashing */
+    if (dictIsRehashing(d) || d->ht[0].used > size)
         return DICT_ERR;
 
-    _dictInit(&n, ht->type, ht->privdata);
     n.size = realsize;
     n.sizemask = realsize-1;
     n.table = _dictAlloc(realsize*sizeof(dictEntry*));
+    n.ctrl = NULL;
+    n.used = 0;
+    n.deleted = 0;
 
     /* Initialize all the pointers to NULL */
     memset(n.table, 0, realsize*sizeof(dictEntry*));
 
-    /* Copy all the elements from the old to the new table:
-     * note that if the old hash table is empty ht->size is zero,
-     * so dictExpand just creates an hash table. */
-    n.used = ht->used;
-    for (i = 0; i < ht->size && ht->used > 0; i++) {
+    /* Is this the first initialization? Then it's not really a rehashing,
+     * we just set the first hash table so that it can accept keys. */
+    if (d->ht[0].table == NULL) {
+        d->ht[0] = n;
+        return DICT_OK;
+    }
+
+    /* Prepare a second hash table for incremental rehashing */
+    d->ht[1] = n;
+    d->rehashidx = 0;
+    return DICT_OK;
+}
+
+/* Performs N steps of incremental rehashing, moving all the elements of
+ * N buckets from the old to the new table. Returns 1 if there are still
+ * keys to move from the old to the new hash table, otherwise 0. */
+int dictRehash(dict *d, int n)
+{
+    if (d->openaddressing) return _dictOaRehash(d,n);
+    if (!dictIsRehashing(d)) return 0;
+
+    while(n--) {
         dictEntry *he, *nextHe;
 
-        if (ht->table[i] == NULL) continue;
-        
-        /* For each hash entry on this slot... */
-        he = ht->table[i];
+        /* Check if we already rehashed the whole table... */
+        if (d->ht[0].used == 0) {
+            _dictFree(d->ht[0].table);
+            d->ht[0] = d->ht[1];
+            _dictReset(&d->ht[1]);
+            d->rehashidx = -1;
+            return 0;
+        }
+
+        /* Note that rehashidx can't overflow as we are sure there are more
+         * elements because ht[0].used != 0 */
+        while(d->ht[0].table[d->rehashidx] == NULL) d->rehashidx++;
+        he = d->ht[0].table[d->rehashidx];
+        /* Move all the keys in this bucket from the old to the new hash HT */
         while(he) {
-            unsigned int h;
+            unsigned long h;
 
             nextHe = he->next;
-            /* Get the new element index */
-            h = dictHashKey(ht, he->key) & n.sizemask;
-            he->next = n.table[h];
-            n.table[h] = he;
-            ht->used--;
-            /* Pass to the next element */
+            /* Get the index in the new hash table, using the cached hash
+             * so that the keys are not touched at all while rehashing.
+             * Only tables of more than 2^32 buckets need the full hash. */
+            if (d->ht[1].sizemask <= DICT_HASH_TAG_MASK)
+                h = he->hash & d->ht[1].sizemask;
+            else
+                h = _dictHashKey(d, he->key, _dictSdsKeys(d)) &
+                    d->ht[1].sizemask;
+            he->next = d->ht[1].table[h];
+            d->ht[1].table[h] = he;
+            d->ht[0].used--;
+            d->ht[1].used++;
             he = nextHe;
         }
+        d->ht[0].table[d->rehashidx] = NULL;
+        d->rehashidx++;
     }
-    assert(ht->used == 0);
-    _dictFree(ht->table);
+    return 1;
+}
 
-    /* Remap the new hashtable in the old */
-    *ht = n;
-    return DICT_OK;
+static long long timeInMilliseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
 }
 
-/* Add an element to the target hash table */
-int dictAdd(dict *ht, void *key, void *val)
+/* Rehash for an amount of time between ms milliseconds and ms+1
+ * milliseconds, 100 buckets at a time. Returns the number of steps. */
+int dictRehashMilliseconds(dict *d, int ms) {
+    long long start = timeInMilliseconds();
+    int rehashes = 0;
+
+    while(dictRehash(d,100)) {
+        rehashes += 100;
+        if (timeInMilliseconds()-start > ms) break;
+    }
+    return rehashes;
+}
+
+/* This function performs just a step of rehashing, and only if there are
+ * no iterators bound to our hash table. When we have iterators in the
+ * middle of a rehashing we can't mess with the two hash tables otherwise
+ * some element can be missed or duplicated.
+ *
+ * This function is called by common lookup or update operations in the
+ * dictionary so that the hash table automatically migrates from H1 to H2
+ * while it is actively used. */
+static void _dictRehashStep(dict *d) {
+    if (d->iterators == 0) dictRehash(d,1);
+}
+
+/* Return the entry of 'key', adding it with a NULL value if it's not
+ * already in the dictionary, so that the key is hashed and the bucket is
+ * walked only once. '*added' is set to 1 if the entry was created: the
+ * dictionary took ownership of the key and the caller must set the value
+ * ASAP with dictSetHashVal(). Otherwise it's set to 0 and the key is
+ * still owned by the caller. 'h' must be the hash of the key. */
+DICT_INLINE dictEntry *_dictFindOrAdd(dict *d, void *key, uint64_t h,
+        int *added, int sdskeys)
 {
-    int index;
+    long index;
     dictEntry *entry;
+    dictht *ht;
+
+    if (d->openaddressing) return _dictOaFindOrAdd(d,key,h,added,sdskeys);
+    if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(ht, key)) == -1)
-        return DICT_ERR;
+    if ((index = _dictKeyIndex(d, key, h, &entry, sdskeys)) == -1) {
+        *added = 0;
+        return entry; /* NULL if the table could not be expanded */
+    }
 
-    /* Allocates the memory and stores key */
-    entry = _dictAlloc(sizeof(*entry));
+    /* Allocates the memory and stores key. While rehashing new elements
+     * go directly in the new table. */
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    entry = _dictCreateEntry(d, key, h, sdskeys);
     entry->next = ht->table[index];
     ht->table[index] = entry;
-
-    /* Set the hash entry fields. */
-    dictSetHashKey(ht, entry, key);
-    dictSetHashVal(ht, entry, val);
     ht->used++;
+    *added = 1;
+    return entry;
+}
+
+dictEntry *dictFindOrAdd(dict *d, void *key, int *added)
+{
+    if (_dictSdsKeys(d))
+        return _dictFindOrAdd(d, key, _dictHashKey(d, key, 1), added, 1);
+    return _dictFindOrAdd(d, key, _dictHashKey(d, key, 0), added, 0);
+}
+
+/* Like dictFindOrAdd() with the hash of the key already computed by
+ * dictGetHash(), for callers that need to access the same key again */
+dictEntry *dictFindOrAddWithHash(dict *d, void *key, uint64_t hash,
+        int *added)
+{
+    if (_dictSdsKeys(d))
+        return _dictFindOrAdd(d, key, hash, added, 1);
+    return _dictFindOrAdd(d, key, hash, added, 0);
+}
+
+uint64_t dictGetHash(dict *d, const void *key)
+{
+    if (_dictSdsKeys(d))
+        return _dictHashKey(d, key, 1);
+    return _dictHashKey(d, key, 0);
+}
+
+/* Add an element to the target hash table */
+int dictAdd(dict *d, void *key, void *val)
+{
+    dictEntry *entry;
+    int added;
+
+    entry = dictFindOrAdd(d, key, &added);
+    if (!added) return DICT_ERR;
+    dictSetHashVal(d, entry, val);
     return DICT_OK;
 }
 
+/* Set the value of an entry, releasing the old one. The new value is set
+ * before freeing the old, as they may be the same object. */
+void dictReplaceEntryVal(dict *d, dictEntry *entry, void *val)
+{
+    dictEntry auxentry = *entry;
+
+    dictSetHashVal(d, entry, val);
+    dictFreeEntryVal(d, &auxentry);
+}
+
 /* Add an element, discarding the old if the key already exists */
-int dictReplace(dict *ht, void *key, void *val)
+int dictReplace(dict *d, void *key, void *val)
 {
     dictEntry *entry;
-
-    /* Try to add the element. If the key
-     * does not exists dictAdd will suceed. */
-    if (dictAdd(ht, key, val) == DICT_OK)
-        return DICT_OK;
-    /* It already exists, get the entry */
-    entry = dictFind(ht, key);
-    /* Free the old value and set the new one */
-    dictFreeEntryVal(ht, entry);
-    dictSetHashVal(ht, entry, val);
+    int added;
+
+    entry = dictFindOrAdd(d, key, &added);
+    if (entry == NULL) return DICT_ERR;
+    if (added)
+        dictSetHashVal(d, entry, val);
+    else
+        dictReplaceEntryVal(d, entry, val);
     return DICT_OK;
 }
 
 /* Search and remove an element */
-static int dictGenericDelete(dict *ht, const void *key, int nofree)
+DICT_INLINE int dictGenericDelete(dict *d, const void *key, int nofree,
+        int sdskeys)
 {
-    unsigned int h;
+    uint64_t h;
+    unsigned long idx;
     dictEntry *he, *prevHe;
+    int table;
 
-    if (ht->size == 0)
-        return DICT_ERR;
-    h = dictHashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
+    if (d->openaddressing) return _dictOaGenericDelete(d,key,nofree,sdskeys);
+    if (d->ht[0].size == 0) return DICT_ERR; /* d->ht[0].table is NULL */
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = _dictHashKey(d, key, sdskeys);
 
-    prevHe = NULL;
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key)) {
-            /* Unlink the element from the list */
-            if (prevHe)
-                prevHe->next = he->next;
-            else
-                ht->table[h] = he->next;
-            if (!nofree) {
-                dictFreeEntryKey(ht, he);
-                dictFreeEntryVal(ht, he);
+    for (table = 0; table <= 1; table++) {
+        idx = h & d->ht[table].sizemask;
+        he = d->ht[table].table[idx];
+        prevHe = NULL;
+        while(he) {
+            if (he->hash == _dictHashTag(h) &&
+                _dictCompareKeys(d, key, he->key, sdskeys))
+            {
+                /* Unlink the element from the list */
+                if (prevHe)
+                    prevHe->next = he->next;
+                else
+                    d->ht[table].table[idx] = he->next;
+                if (!nofree) {
+                    _dictFreeEntryKey(d, he, sdskeys);
+                    dictFreeEntryVal(d, he);
+                }
+                _dictFreeEntry(d, he);
+                d->ht[table].used--;
+                return DICT_OK;
             }
-            _dictFree(he);
-            ht->used--;
-            return DICT_OK;
+            prevHe = he;
+            he = he->next;
         }
-        prevHe = he;
-        he = he->next;
+        if (!dictIsRehashing(d)) break;
     }
     return DICT_ERR; /* not found */
 }
 
 int dictDelete(dict *ht, const void *key) {
-    return dictGenericDelete(ht,key,0);
+    if (_dictSdsKeys(ht))
+        return dictGenericDelete(ht,key,0,1);
+    return dictGenericDelete(ht,key,0,0);
 }
 
 int dictDeleteNoFree(dict *ht, const void *key) {
-    return dictGenericDelete(ht,key,1);
+    if (_dictSdsKeys(ht))
+        return dictGenericDelete(ht,key,1,1);
+    return dictGenericDelete(ht,key,1,0);
 }
 
 /* Destroy an entire hash table */
-int _dictClear(dict *ht)
+static int _dictClear(dict *d, dictht *ht)
 {
-    unsigned int i;
+    unsigned long i;
 
+    if (d->openaddressing) return _dictOaClear(d,ht);
     /* Free all the elements */
     for (i = 0; i < ht->size && ht->used > 0; i++) {
         dictEntry *he, *nextHe;
@@ -265,9 +584,9 @@ int _dictClear(dict *ht)
         if ((he = ht->table[i]) == NULL) continue;
         while(he) {
             nextHe = he->next;
-            dictFreeEntryKey(ht, he);
-            dictFreeEntryVal(ht, he);
-            _dictFree(he);
+            _dictFreeEntryKey(d, he, _dictSdsKeys(d));
+            dictFreeEntryVal(d, he);
+            _dictFreeEntry(d, he);
             ht->used--;
             he = nextHe;
         }
@@ -280,47 +599,147 @@ int _dictClear(dict *ht)
 }
 
 /* Clear & Release the hash table */
-void dictRelease(dict *ht)
+void dictRelease(dict *d)
 {
-    _dictClear(ht);
-    _dictFree(ht);
+    _dictClear(d,&d->ht[0]);
+    _dictClear(d,&d->ht[1]);
+    _dictFree(d);
 }
 
-dictEntry *dictFind(dict *ht, const void *key)
+DICT_INLINE dictEntry *_dictFind(dict *d, const void *key, int sdskeys)
 {
     dictEntry *he;
-    unsigned int h;
-
-    if (ht->size == 0) return NULL;
-    h = dictHashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key))
-            return he;
-        he = he->next;
+    uint64_t h;
+    unsigned long idx;
+    int table;
+
+    if (d->openaddressing) return _dictOaFind(d,key,sdskeys);
+    if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = _dictHashKey(d, key, sdskeys);
+    for (table = 0; table <= 1; table++) {
+        idx = h & d->ht[table].sizemask;
+        he = d->ht[table].table[idx];
+        while(he) {
+            if (he->hash == _dictHashTag(h) &&
+                _dictCompareKeys(d, key, he->key, sdskeys)) return he;
+            he = he->next;
+        }
+        if (!dictIsRehashing(d)) return NULL;
     }
     return NULL;
 }
 
-dictIterator *dictGetIterator(dict *ht)
+dictEntry *dictFind(dict *d, const void *key)
+{
+    if (_dictSdsKeys(d))
+        return _dictFind(d, key, 1);
+    return _dictFind(d, key, 0);
+}
+
+/* Look up 'count' keys (at most DICT_BATCH_SIZE) storing the entries found,
+ * or NULL, in 'entries'. First all the keys are hashed and their buckets
+ * prefetched, then the first entries of the chains, and only then the keys
+ * are compared, so that the cache misses of the different lookups overlap
+ * instead of being serialized like when calling dictFind() in a loop. */
+DICT_INLINE void _dictFindBatch(dict *d, void **keys, dictEntry **entries,
+        int count, int sdskeys)
+{
+    uint64_t h[DICT_BATCH_SIZE];
+    dictht *ht = &d->ht[0];
+    int j;
+
+    if (ht->size == 0) {
+        for (j = 0; j < count; j++) entries[j] = NULL;
+        return;
+    }
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (dictIsRehashing(d)) {
+        /* Two tables to look into: not worth the complexity */
+        for (j = 0; j < count; j++)
+            entries[j] = _dictFind(d, keys[j], sdskeys);
+        return;
+    }
+    if (d->openaddressing) {
+        _dictOaFindBatch(d, keys, entries, count, sdskeys);
+        return;
+    }
+    for (j = 0; j < count; j++) {
+        h[j] = _dictHashKey(d, keys[j], sdskeys);
+        _dictPrefetch(&ht->table[h[j] & ht->sizemask]);
+    }
+    for (j = 0; j < count; j++) {
+        entries[j] = ht->table[h[j] & ht->sizemask];
+        if (entries[j]) _dictPrefetch(entries[j]);
+    }
+    for (j = 0; j < count; j++) {
+        dictEntry *he = entries[j];
+
+        if (he && he->hash == _dictHashTag(h[j])) _dictPrefetch(he->key);
+    }
+    for (j = 0; j < count; j++) {
+        dictEntry *he = entries[j];
+
+        while(he) {
+            if (he->hash == _dictHashTag(h[j]) &&
+                _dictCompareKeys(d, keys[j], he->key, sdskeys)) break;
+            he = he->next;
+        }
+        entries[j] = he;
+    }
+}
+
+void dictFindMany(dict *d, void **keys, dictEntry **entries, int count)
+{
+    while(count > 0) {
+        int n = (count > DICT_BATCH_SIZE) ? DICT_BATCH_SIZE : count;
+
+        if (_dictSdsKeys(d))
+            _dictFindBatch(d, keys, entries, n, 1);
+        else
+            _dictFindBatch(d, keys, entries, n, 0);
+        keys += n;
+        entries += n;
+        count -= n;
+    }
+}
+
+dictIterator *dictGetIterator(dict *d)
 {
     dictIterator *iter = _dictAlloc(sizeof(*iter));
 
-    iter->ht = ht;
+    iter->d = d;
+    iter->table = 0;
     iter->index = -1;
     iter->entry = NULL;
     iter->nextEntry = NULL;
     return iter;
 }
 
+/* Return the next element of both the hash tables. While an iterator is
+ * active the incremental rehashing is paused, so the user can delete the
+ * returned entry or add elements without elements being missed or
+ * returned twice. */
 dictEntry *dictNext(dictIterator *iter)
 {
+    if (iter->d->openaddressing) return _dictOaNext(iter);
     while (1) {
         if (iter->entry == NULL) {
+            dictht *ht = &iter->d->ht[iter->table];
+
+            if (iter->index == -1 && iter->table == 0)
+                iter->d->iterators++;
             iter->index++;
-            if (iter->index >=
-                    (signed)iter->ht->size) break;
-            iter->entry = iter->ht->table[iter->index];
+            if (iter->index >= (long) ht->size) {
+                if (dictIsRehashing(iter->d) && iter->table == 0) {
+                    iter->table++;
+                    iter->index = 0;
+                    ht = &iter->d->ht[1];
+                } else {
+                    break;
+                }
+            }
+            iter->entry = ht->table[iter->index];
         } else {
             iter->entry = iter->nextEntry;
         }
@@ -336,59 +755,185 @@ dictEntry *dictNext(dictIterator *iter)
 
 void dictReleaseIterator(dictIterator *iter)
 {
+    if (!(iter->index == -1 && iter->table == 0))
+        iter->d->iterators--;
     _dictFree(iter);
 }
 
 /* Return a random entry from the hash table. Useful to
  * implement randomized algorithms */
-dictEntry *dictGetRandomKey(dict *ht)
+dictEntry *dictGetRandomKey(dict *d)
 {
-    dictEntry *he;
-    unsigned int h;
+    dictEntry *he, *orighe;
+    unsigned long h;
     int listlen, listele;
 
-    if (ht->size == 0) return NULL;
-    do {
-        h = random() & ht->sizemask;
-        he = ht->table[h];
-    } while(he == NULL);
+    if (d->openaddressing) return _dictOaGetRandomKey(d);
+    if (dictGetHashTableUsed(d) == 0) return NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (dictIsRehashing(d)) {
+        /* Pick a bucket in both tables. The buckets of the old one
+         * already rehashed are empty. */
+        do {
+            h = _dictRandom() % (d->ht[0].size+d->ht[1].size);
+            he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
+                                        d->ht[0].table[h];
+        } while(he == NULL);
+    } else {
+        do {
+            h = _dictRandom() & d->ht[0].sizemask;
+            he = d->ht[0].table[h];
+        } while(he == NULL);
+    }
 
     /* Now we found a non empty bucket, but it is a linked
      * list and we need to get a random element from the list.
      * The only sane way to do so is to count the element and
      * select a random index. */
     listlen = 0;
+    orighe = he;
     while(he) {
         he = he->next;
         listlen++;
     }
     listele = random() % listlen;
-    he = ht->table[h];
+    he = orighe;
     while(listele--) he = he->next;
     return he;
 }
 
+/* Reverse the bits of v, used to increment the dictScan() cursor */
+static unsigned long rev(unsigned long v) {
+    unsigned long s = 8 * sizeof(v); /* bit size; must be power of 2 */
+    unsigned long mask = ~0UL;
+
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+/* Call 'fn' for the entries of the bucket 'idx' of a chained table, or
+ * for the entries having 'idx' as home group in an open addressing table.
+ * For dictScan() the groups of open addressing tables are what the
+ * buckets are for chaining: a table of 2^N groups maps the cursor to the
+ * groups exactly like a chained table of 2^N buckets. */
+static void _dictScanBucket(dict *d, dictht *ht, unsigned long idx,
+        dictScanFunction *fn, void *privdata)
+{
+    const dictEntry *de;
+
+    if (d->openaddressing) {
+        _dictOaScanGroup(d, ht, idx, fn, privdata);
+        return;
+    }
+    de = ht->table[idx];
+    while (de) {
+        fn(privdata, de);
+        de = de->next;
+    }
+}
+
+#define _dictScanMask(d, ht) \
+    ((d)->openaddressing ? _dictOaGroupMask(ht) : (ht)->sizemask)
+
+/* dictScan() is used to iterate over the elements of a dictionary in
+ * small steps, without keeping state in the server between the calls.
+ *
+ * Start calling it with a cursor 'v' of 0: every call invokes 'fn' for all
+ * the entries of a bucket (of a bucket in both tables while rehashing) and
+ * returns the cursor to use in the next call. When 0 is returned the
+ * iteration is complete.
+ *
+ * Every element present in the dictionary for the whole iteration is
+ * returned at least once, even if the table is expanded or shrunk between
+ * the calls, but elements may be returned multiple times. This is obtained
+ * incrementing the cursor starting from its high bits (reverse binary
+ * iteration): the buckets already visited in a table of size 2^N map
+ * exactly to the buckets of a table of size 2^M already visited with the
+ * same cursor, so a resize never makes the iteration miss a bucket.
+ *
+ * Since the cursor is just the index of the next bucket (of the next home
+ * group with open addressing), 'fn' must not modify the dictionary. */
+unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn,
+        void *privdata)
+{
+    dictht *t0, *t1;
+    unsigned long m0, m1;
+
+    if (dictGetHashTableUsed(d) == 0) return 0;
+
+    if (!dictIsRehashing(d)) {
+        t0 = &(d->ht[0]);
+        m0 = _dictScanMask(d, t0);
+
+        /* Emit entries at cursor */
+        _dictScanBucket(d, t0, v & m0, fn, privdata);
+    } else {
+        t0 = &d->ht[0];
+        t1 = &d->ht[1];
+
+        /* Make sure t0 is the smaller and t1 is the bigger table */
+        if (t0->size > t1->size) {
+            t0 = &d->ht[1];
+            t1 = &d->ht[0];
+        }
+
+        m0 = _dictScanMask(d, t0);
+        m1 = _dictScanMask(d, t1);
+
+        /* Emit entries at cursor */
+        _dictScanBucket(d, t0, v & m0, fn, privdata);
+
+        /* Iterate over indices in larger table that are the expansion
+         * of the index pointed to by the cursor in the smaller table */
+        do {
+            /* Emit entries at cursor */
+            _dictScanBucket(d, t1, v & m1, fn, privdata);
+
+            /* Increment bits not covered by the smaller mask */
+            v = (((v | m0) + 1) & ~m0) | (v & m0);
+
+            /* Continue while bits covered by mask difference is non-zero */
+        } while (v & (m0 ^ m1));
+    }
+
+    /* Set unmasked bits so incrementing the reversed cursor
+     * operates on the masked bits of the smaller table */
+    v |= ~m0;
+
+    /* Increment the reverse cursor */
+    v = rev(v);
+    v++;
+    v = rev(v);
+    return v;
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
-static int _dictExpandIfNeeded(dict *ht)
+static int _dictExpandIfNeeded(dict *d)
 {
+    /* Incremental rehashing already in progress. Return. */
+    if (dictIsRehashing(d)) return DICT_OK;
+
     /* If the hash table is empty expand it to the intial size,
      * if the table is "full" dobule its size. */
-    if (ht->size == 0)
-        return dictExpand(ht, DICT_HT_INITIAL_SIZE);
-    if (ht->used == ht->size)
-        return dictExpand(ht, ht->size*2);
+    if (d->ht[0].size == 0)
+        return dictExpand(d, DICT_HT_INITIAL_SIZE);
+    if (d->ht[0].used >= d->ht[0].size)
+        return dictExpand(d, d->ht[0].size*2);
     return DICT_OK;
 }
 
 /* Our hash table capability is a power of two */
-static unsigned int _dictNextPower(unsigned int size)
+static unsigned long _dictNextPower(unsigned long size)
 {
-    unsigned int i = DICT_HT_INITIAL_SIZE;
+    unsigned long i = DICT_HT_INITIAL_SIZE;
 
-    if (size >= 2147483648U)
-        return 2147483648U;
+    if (size >= LONG_MAX)
+        return LONG_MAX + 1LU;
     while(1) {
         if (i >= size)
             return i;
@@ -398,32 +943,44 @@ static unsigned int _dictNextPower(unsigned int size)
 
 /* Returns the index of a free slot that can be populated with
  * an hash entry for the given 'key'.
- * If the key already exists, -1 is returned. */
-static int _dictKeyIndex(dict *ht, const void *key)
+ * If the key already exists, -1 is returned and the entry is stored
+ * in '*existing' (that is set to NULL if the table can't be expanded).
+ *
+ * Note that if we are in the process of rehashing the hash table, the
+ * index is always returned in the context of the second (new) hash table. */
+DICT_INLINE long _dictKeyIndex(dict *d, const void *key, uint64_t h,
+        dictEntry **existing, int sdskeys)
 {
-    unsigned int h;
+    unsigned long idx;
+    int table;
     dictEntry *he;
 
+    *existing = NULL;
     /* Expand the hashtable if needed */
-    if (_dictExpandIfNeeded(ht) == DICT_ERR)
+    if (_dictExpandIfNeeded(d) == DICT_ERR)
         return -1;
-    /* Compute the key hash value */
-    h = dictHashKey(ht, key) & ht->sizemask;
-    /* Search if this slot does not already contain the given key */
-    he = ht->table[h];
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key))
-            return -1;
-        he = he->next;
+    for (table = 0; table <= 1; table++) {
+        idx = h & d->ht[table].sizemask;
+        /* Search if this slot does not already contain the given key */
+        he = d->ht[table].table[idx];
+        while(he) {
+            if (he->hash == _dictHashTag(h) &&
+                _dictCompareKeys(d, key, he->key, sdskeys))
+            {
+                *existing = he;
+                return -1;
+            }
+            he = he->next;
+        }
+        if (!dictIsRehashing(d)) break;
     }
-    return h;
+    return idx;
 }
 
-#define DICT_STATS_VECTLEN 50
-void dictPrintStats(dict *ht) {
-    unsigned int i, slots = 0, chainlen, maxchainlen = 0;
-    unsigned int totchainlen = 0;
-    unsigned int clvector[DICT_STATS_VECTLEN];
+static void _dictPrintStatsHt(dictht *ht) {
+    unsigned long i, slots = 0, chainlen, maxchainlen = 0;
+    unsigned long totchainlen = 0;
+    unsigned long clvector[DICT_STATS_VECTLEN];
 
     if (ht->used == 0) {
         printf("No stats available for empty dictionaries\n");
@@ -451,22 +1008,34 @@ void dictPrintStats(dict *ht) {
         totchainlen += chainlen;
     }
     printf("Hash table stats:\n");
-    printf(" table size: %d\n", ht->size);
-    printf(" number of elements: %d\n", ht->used);
-    printf(" different slots: %d\n", slots);
-    printf(" max chain length: %d\n", maxchainlen);
+    printf(" table size: %lu\n", ht->size);
+    printf(" number of elements: %lu\n", ht->used);
+    printf(" different slots: %lu\n", slots);
+    printf(" max chain length: %lu\n", maxchainlen);
     printf(" avg chain length (counted): %.02f\n", (float)totchainlen/slots);
     printf(" avg chain length (computed): %.02f\n", (float)ht->used/slots);
     printf(" Chain length distribution:\n");
     for (i = 0; i < DICT_STATS_VECTLEN-1; i++) {
         if (clvector[i] == 0) continue;
-        printf("   %s%d: %d (%.02f%%)\n",(i == DICT_STATS_VECTLEN-1)?">= ":"", i, clvector[i], ((float)clvector[i]/ht->size)*100);
+        printf("   %s%lu: %lu (%.02f%%)\n",(i == DICT_STATS_VECTLEN-1)?">= ":"", i, clvector[i], ((float)clvector[i]/ht->size)*100);
+    }
+}
+
+void dictPrintStats(dict *d) {
+    int j;
+
+    for (j = 0; j <= dictIsRehashing(d); j++) {
+        if (j) printf("-- Rehashing into ht[1]:\n");
+        if (d->openaddressing)
+            _dictOaPrintStatsHt(d, &d->ht[j]);
+        else
+            _dictPrintStatsHt(&d->ht[j]);
     }
 }
 
 /* ----------------------- StringCopy Hash Table Type ------------------------*/
 
-static unsigned int _dictStringCopyHTHashFunction(const void *key)
+static uint64_t _dictStringCopyHTHashFunction(const void *key)
 {
     return dictGenHashFunction(key, strlen(key));
 }
@@ -521,7 +1090,10 @@ dictType dictTypeHeapStringCopyKey = {
     NULL,                               /* val dup */
     _dictStringCopyHTKeyCompare,          /* key compare */
     _dictStringCopyHTKeyDestructor,       /* key destructor */
-    NULL                                /* val destructor */
+    NULL,                               /* val destructor */
+    NULL,                               /* key embedded len */
+    NULL,                               /* key embed */
+    0                                   /* flags */
 };
 
 /* This is like StringCopy but does not auto-duplicate the key.
@@ -532,7 +1104,10 @@ dictType dictTypeHeapStrings = {
     NULL,                               /* val dup */
     _dictStringCopyHTKeyCompare,          /* key compare */
     _dictStringCopyHTKeyDestructor,       /* key destructor */
-    NULL                                /* val destructor */
+    NULL,                               /* val destructor */
+    NULL,                               /* key embedded len */
+    NULL,                               /* key embed */
+    0                                   /* flags */
 };
 
 /* This is like StringCopy but also automatically handle dynamic
@@ -544,4 +1119,7 @@ dictType dictTypeHeapStringCopyKeyValue = {
     _dictStringCopyHTKeyCompare,          /* key compare */
     _dictStringCopyHTKeyDestructor,       /* key destructor */
     _dictStringKeyValCopyHTValDestructor, /* val destructor */
+    NULL,                               /* key embedded len */
+    NULL,                               /* key embed */
+    0                                   /* flags */
 };
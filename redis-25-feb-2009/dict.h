@@ -7,6 +7,9 @@
 #ifndef __DICT_H
 #define __DICT_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define DICT_OK 0
 #define DICT_ERR 1
 
@@ -16,36 +19,70 @@
 typedef struct dictEntry {
     void *key;
     void *val;
-    struct dictEntry *next;
+    unsigned int hash; /* low 32 bits of the key hash: rehashing doesn't
+                          need to recompute it (unless the table has more
+                          than 2^32 buckets), lookups skip most compares */
+    unsigned int keyembedlen; /* bytes of the key stored in the entry
+                                 allocation itself, 0 if not embedded */
+    struct dictEntry *next; /* must be the last field: not used, and not
+                               allocated, by open addressing dicts */
 } dictEntry;
 
 typedef struct dictType {
-    unsigned int (*hashFunction)(const void *key);
+    uint64_t (*hashFunction)(const void *key);
     void *(*keyDup)(void *privdata, const void *key);
     void *(*valDup)(void *privdata, const void *obj);
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* Optional: when keyEmbedLen() returns N > 0 the key is copied by
+     * keyEmbed() into N bytes allocated together with the dictEntry, and
+     * the original key is released (unless the type has a keyDup). */
+    size_t (*keyEmbedLen)(void *privdata, const void *key);
+    void *(*keyEmbed)(void *privdata, void *buf, const void *key);
+    int flags;
 } dictType;
 
-typedef struct dict {
+/* dictType flags */
+#define DICT_TYPE_SDS_KEYS 1 /* sds keys owned by the dictionary: they are
+                                hashed with dictGenHashFunction(), compared
+                                and freed without calling the type methods */
+
+/* This is our hash table structure. Every dictionary has two of this as we
+ * implement incremental rehashing, for the old to the new table. */
+typedef struct dictht {
     dictEntry **table;
+    unsigned char *ctrl;    /* open addressing: a control byte per slot */
+    unsigned long size;
+    unsigned long sizemask;
+    unsigned long used;
+    unsigned long deleted;  /* open addressing: deleted slots */
+} dictht;
+
+typedef struct dict {
     dictType *type;
-    unsigned int size;
-    unsigned int sizemask;
-    unsigned int used;
     void *privdata;
+    dictht ht[2];
+    long rehashidx; /* rehashing not in progress if rehashidx == -1 */
+    int iterators; /* number of iterators currently running */
+    int openaddressing; /* hash tables of dict_oa.c instead of chaining */
 } dict;
 
+typedef void dictScanFunction(void *privdata, const dictEntry *de);
+
 typedef struct dictIterator {
-    dict *ht;
-    int index;
+    dict *d;
+    int table;
+    long index;
     dictEntry *entry, *nextEntry;
 } dictIterator;
 
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     16
 
+/* Lookups performed together by dictFindMany() */
+#define DICT_BATCH_SIZE          16
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeEntryVal(ht, entry) \
     if ((ht)->type->valDestructor) \
@@ -59,7 +96,7 @@ typedef struct dictIterator {
 } while(0)
 
 #define dictFreeEntryKey(ht, entry) \
-    if ((ht)->type->keyDestructor) \
+    if ((ht)->type->keyDestructor && !(entry)->keyembedlen) \
         (ht)->type->keyDestructor((ht)->privdata, (entry)->key)
 
 #define dictSetHashKey(ht, entry, _key_) do { \
@@ -78,25 +115,45 @@ typedef struct dictIterator {
 
 #define dictGetEntryKey(he) ((he)->key)
 #define dictGetEntryVal(he) ((he)->val)
-#define dictGetHashTableSize(ht) ((ht)->size)
-#define dictGetHashTableUsed(ht) ((ht)->used)
+#define dictGetHashTableSize(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictGetHashTableUsed(d) ((d)->ht[0].used+(d)->ht[1].used)
+#define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictIsOpenAddressing(d) ((d)->openaddressing)
+/* Memory used by a table slot (not counting the entry) and by an entry */
+#define dictGetSlotBytes(d) (sizeof(dictEntry*)+((d)->openaddressing != 0))
+#define dictGetEntryBytes(d) \
+    ((d)->openaddressing ? offsetof(dictEntry,next) : sizeof(dictEntry))
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
-int dictExpand(dict *ht, unsigned int size);
+dict *dictCreateOpenAddressing(dictType *type, void *privDataPtr);
+int dictExpand(dict *ht, unsigned long size);
 int dictAdd(dict *ht, void *key, void *val);
 int dictReplace(dict *ht, void *key, void *val);
+dictEntry *dictFindOrAdd(dict *d, void *key, int *added);
+dictEntry *dictFindOrAddWithHash(dict *d, void *key, uint64_t hash,
+        int *added);
+uint64_t dictGetHash(dict *d, const void *key);
+void dictReplaceEntryVal(dict *d, dictEntry *entry, void *val);
 int dictDelete(dict *ht, const void *key);
 int dictDeleteNoFree(dict *ht, const void *key);
 void dictRelease(dict *ht);
 dictEntry * dictFind(dict *ht, const void *key);
+void dictFindMany(dict *d, void **keys, dictEntry **entries, int count);
 int dictResize(dict *ht);
 dictIterator *dictGetIterator(dict *ht);
 dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *ht);
 void dictPrintStats(dict *ht);
-unsigned int dictGenHashFunction(const unsigned char *buf, int len);
+unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn,
+        void *privdata);
+int dictRehash(dict *d, int n);
+int dictRehashMilliseconds(dict *d, int ms);
+uint64_t dictGenHashFunction(const unsigned char *buf, int len);
+void dictSetHashFunctionSeed(uint32_t seed);
+uint32_t dictGetHashFunctionSeed(void);
+unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
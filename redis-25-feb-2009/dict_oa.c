@@ -0,0 +1,528 @@
+/* Open addressing hash tables for dict.c
+ * Copyright (C) 2009 Salvatore Sanfilippo antirez at gmail dot com
+ *
+ * This file is included by dict.c, and implements the hash tables of the
+ * dictionaries created with dictCreateOpenAddressing(). The API and its
+ * guarantees are the same of the chained hash tables.
+ *
+ * A table is an array of slots, pointing to the entries, and an array of
+ * control bytes, one for every slot: DICT_OA_EMPTY, DICT_OA_DELETED, or 7
+ * bits of the hash of the key if the slot is used. The slots are probed in
+ * groups of DICT_OA_GROUP: the control bytes of a group are compared with
+ * the hash bits of the key all together (16 bytes with an SSE2 compare,
+ * otherwise 8 bytes with plain 64 bit arithmetic), so that entries and
+ * keys are only accessed for the slots that will very likely match. The
+ * entries are still allocated one by one, so the entries returned by the
+ * API don't move, exactly like with chaining, but without the 'next'
+ * pointer.
+ *
+ * The hash of a key selects its home group. A new key is stored in the
+ * first group with a free slot of the probe sequence that starts at its
+ * home group and visits the next groups with increasing steps (1, 2, 3...
+ * groups away, so all the groups are visited), and a lookup stops at the
+ * first group with an empty slot. A deleted slot becomes empty only if
+ * there is already an empty slot in its group, otherwise it is marked as
+ * DICT_OA_DELETED, so that the groups a lookup has to go past never get
+ * empty slots. Tables are kept at most 7/8 full, deleted slots included.
+ *
+ * Incremental rehashing works like with chaining, a group at a time.
+ */
+
+#define DICT_OA_EMPTY       0x80
+#define DICT_OA_DELETED     0xfe
+
+/* Used slots have the high bit of the control byte clear */
+#define _dictOaIsUsed(c) ((c) < 0x80)
+/* 7 bits of hash for the control byte. The low bits of the hash select
+ * the group: the high bits are taken after a multiplication, so that they
+ * depend on all the bits of the hash, even if the hash function doesn't
+ * mix the high bits well. */
+#define _dictOaH2(h) ((unsigned char)((_dictHashTag(h)*2654435769U) >> 25))
+#define _dictOaGroupMask(ht) ((ht)->sizemask / DICT_OA_GROUP)
+#define _dictOaMaxFill(size) ((size)-(size)/8)
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+#define DICT_OA_GROUP 16
+/* Bit j of a match mask is set for the slot j of the group */
+typedef unsigned int dictOaMask;
+
+static dictOaMask _dictOaMatch(const unsigned char *ctrl, unsigned char h2) {
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g,_mm_set1_epi8((char)h2)));
+}
+
+static dictOaMask _dictOaMatchEmpty(const unsigned char *ctrl) {
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g,
+        _mm_set1_epi8((char)DICT_OA_EMPTY)));
+}
+
+/* Empty and deleted slots have the high bit set */
+static dictOaMask _dictOaMatchFree(const unsigned char *ctrl) {
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+
+#define _dictOaFirst(m) ((unsigned int)__builtin_ctz(m))
+#else
+#define DICT_OA_GROUP 8
+/* The high bit of byte j of a match mask is set for the slot j */
+typedef uint64_t dictOaMask;
+
+#define DICT_OA_LSBS 0x0101010101010101ULL
+#define DICT_OA_MSBS 0x8080808080808080ULL
+
+/* Load the control bytes of a group: byte j goes in bits 8*j ... 8*j+7 */
+static uint64_t _dictOaLoad(const unsigned char *ctrl) {
+    uint64_t g;
+
+    memcpy(&g,ctrl,sizeof(g));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    g = __builtin_bswap64(g);
+#endif
+    return g;
+}
+
+/* There may be false positives (next to a real match), it's fine since
+ * the keys are compared anyway. */
+static dictOaMask _dictOaMatch(const unsigned char *ctrl, unsigned char h2) {
+    uint64_t x = _dictOaLoad(ctrl) ^ (DICT_OA_LSBS * h2);
+
+    return (x - DICT_OA_LSBS) & ~x & DICT_OA_MSBS;
+}
+
+/* EMPTY has the high bit set and bit 1 clear, DELETED has both set */
+static dictOaMask _dictOaMatchEmpty(const unsigned char *ctrl) {
+    uint64_t g = _dictOaLoad(ctrl);
+
+    return g & ~(g << 6) & DICT_OA_MSBS;
+}
+
+static dictOaMask _dictOaMatchFree(const unsigned char *ctrl) {
+    return _dictOaLoad(ctrl) & DICT_OA_MSBS;
+}
+
+#ifdef __GNUC__
+#define _dictOaFirst(m) ((unsigned int)__builtin_ctzll(m) >> 3)
+#else
+static unsigned int _dictOaFirst(dictOaMask m) {
+    unsigned int j = 0;
+
+    while(!(m & 0x80)) {
+        m >>= 8;
+        j++;
+    }
+    return j;
+}
+#endif
+#endif /* __SSE2__ */
+
+/* The hash of an entry as needed to find its slot in the table 'ht': the
+ * bits cached in the entry are enough unless the table has more than
+ * 2^32 groups. */
+DICT_INLINE uint64_t _dictOaEntryHash(dict *d, dictht *ht, dictEntry *he) {
+    if (_dictOaGroupMask(ht) <= DICT_HASH_TAG_MASK) return he->hash;
+    return _dictHashKey(d, he->key, _dictSdsKeys(d));
+}
+
+/* Return the slot of 'key' in the table, or -1 if it's not there */
+DICT_INLINE long _dictOaLookup(dict *d, dictht *ht, const void *key,
+        uint64_t h, int sdskeys)
+{
+    unsigned long mask = _dictOaGroupMask(ht), g = h & mask, step = 0;
+    unsigned char h2 = _dictOaH2(h);
+
+    while(1) {
+        unsigned long base = g*DICT_OA_GROUP;
+        dictOaMask m = _dictOaMatch(ht->ctrl+base,h2);
+
+        while(m) {
+            unsigned long idx = base+_dictOaFirst(m);
+
+            if (_dictOaIsUsed(ht->ctrl[idx]) &&
+                ht->table[idx]->hash == _dictHashTag(h) &&
+                _dictCompareKeys(d, key, ht->table[idx]->key, sdskeys))
+                return idx;
+            m &= m-1;
+        }
+        if (_dictOaMatchEmpty(ht->ctrl+base)) return -1;
+        g = (g+(++step)) & mask;
+    }
+}
+
+/* Return the first free slot of the probe sequence of the hash 'h'. There
+ * is always one, the table is never full. */
+static unsigned long _dictOaFreeSlot(dictht *ht, uint64_t h) {
+    unsigned long mask = _dictOaGroupMask(ht), g = h & mask, step = 0;
+
+    while(1) {
+        unsigned long base = g*DICT_OA_GROUP;
+        dictOaMask m = _dictOaMatchFree(ht->ctrl+base);
+
+        if (m) return base+_dictOaFirst(m);
+        g = (g+(++step)) & mask;
+    }
+}
+
+static void _dictOaSetSlot(dictht *ht, unsigned long idx, dictEntry *he,
+        uint64_t h)
+{
+    if (ht->ctrl[idx] == DICT_OA_DELETED) ht->deleted--;
+    ht->ctrl[idx] = _dictOaH2(h);
+    ht->table[idx] = he;
+    ht->used++;
+}
+
+static void _dictOaClearSlot(dictht *ht, unsigned long idx) {
+    unsigned long base = idx & ~(unsigned long)(DICT_OA_GROUP-1);
+
+    if (_dictOaMatchEmpty(ht->ctrl+base)) {
+        ht->ctrl[idx] = DICT_OA_EMPTY;
+    } else {
+        ht->ctrl[idx] = DICT_OA_DELETED;
+        ht->deleted++;
+    }
+    ht->used--;
+}
+
+/* See dictExpand() */
+static int _dictOaExpand(dict *d, unsigned long size)
+{
+    dictht n; /* the new hashtable */
+    unsigned long realsize = _dictNextPower(size);
+
+    if (dictIsRehashing(d) || d->ht[0].used > size)
+        return DICT_ERR;
+    if (size > _dictOaMaxFill(realsize) && realsize <= LONG_MAX)
+        realsize *= 2;
+
+    /* Slots and control bytes are allocated together. The slots are only
+     * read when the control byte says they are used: no need to clear
+     * them. */
+    n.size = realsize;
+    n.sizemask = realsize-1;
+    n.table = _dictAlloc(realsize*(sizeof(dictEntry*)+1));
+    n.ctrl = (unsigned char*)(n.table+realsize);
+    memset(n.ctrl, DICT_OA_EMPTY, realsize);
+    n.used = 0;
+    n.deleted = 0;
+
+    if (d->ht[0].table == NULL) {
+        d->ht[0] = n;
+        return DICT_OK;
+    }
+    d->ht[1] = n;
+    d->rehashidx = 0;
+    return DICT_OK;
+}
+
+/* See dictRehash(). Every step moves the elements of a group. */
+static int _dictOaRehash(dict *d, int n)
+{
+    if (!dictIsRehashing(d)) return 0;
+
+    while(n--) {
+        dictht *t0 = &d->ht[0], *t1 = &d->ht[1];
+        unsigned long j, base;
+
+        /* Check if we already rehashed the whole table... */
+        if (t0->used == 0) {
+            _dictFree(t0->table);
+            d->ht[0] = d->ht[1];
+            _dictReset(&d->ht[1]);
+            d->rehashidx = -1;
+            return 0;
+        }
+
+        /* rehashidx can't overflow as there are more elements */
+        base = d->rehashidx*DICT_OA_GROUP;
+        for (j = base; j < base+DICT_OA_GROUP; j++) {
+            dictEntry *he;
+            uint64_t h;
+
+            if (!_dictOaIsUsed(t0->ctrl[j])) continue;
+            he = t0->table[j];
+            h = _dictOaEntryHash(d, t1, he);
+            _dictOaSetSlot(t1, _dictOaFreeSlot(t1,h), he, h);
+            _dictOaClearSlot(t0, j);
+        }
+        d->rehashidx++;
+    }
+    return 1;
+}
+
+/* Expand the hash table if needed */
+static int _dictOaExpandIfNeeded(dict *d)
+{
+    dictht *ht;
+
+    if (dictIsRehashing(d)) {
+        /* The new table has room for all the elements of the old one and
+         * the ones added before the rehashing completes, unless a safe
+         * iterator paused it. Then it is completed now if the iterator
+         * is gone, while with an iterator still active the elements
+         * can't be moved, and the new element can't be added. */
+        ht = &d->ht[1];
+        if (ht->used+ht->deleted < _dictOaMaxFill(ht->size))
+            return DICT_OK;
+        if (d->iterators) return DICT_ERR;
+        while(_dictOaRehash(d,100));
+    }
+
+    /* If the hash table is empty expand it to the intial size. If it is
+     * full, counting the deleted slots, the new table has room for twice
+     * the elements: when most slots were just deleted it has the same
+     * size and only gets rid of them. */
+    ht = &d->ht[0];
+    if (ht->size == 0)
+        return _dictOaExpand(d, DICT_HT_INITIAL_SIZE);
+    if (ht->used+ht->deleted >= _dictOaMaxFill(ht->size))
+        return _dictOaExpand(d, ht->used*2);
+    return DICT_OK;
+}
+
+/* See _dictFindOrAdd(). The key is searched before expanding the table,
+ * so that existing keys are found even when the table is full and can't
+ * be expanded. */
+DICT_INLINE dictEntry *_dictOaFindOrAdd(dict *d, void *key, uint64_t h,
+        int *added, int sdskeys)
+{
+    long idx;
+    int table;
+    dictEntry *entry;
+    dictht *ht;
+
+    *added = 0;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    for (table = 0; table <= 1 && d->ht[0].size; table++) {
+        idx = _dictOaLookup(d, &d->ht[table], key, h, sdskeys);
+        if (idx != -1) return d->ht[table].table[idx];
+        if (!dictIsRehashing(d)) break;
+    }
+    if (_dictOaExpandIfNeeded(d) == DICT_ERR)
+        return NULL;
+
+    /* While rehashing new elements go directly in the new table */
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    entry = _dictCreateEntry(d, key, h, sdskeys);
+    _dictOaSetSlot(ht, _dictOaFreeSlot(ht,h), entry, h);
+    *added = 1;
+    return entry;
+}
+
+/* See dictGenericDelete() */
+DICT_INLINE int _dictOaGenericDelete(dict *d, const void *key, int nofree,
+        int sdskeys)
+{
+    uint64_t h;
+    long idx;
+    int table;
+    dictEntry *he;
+
+    if (d->ht[0].size == 0) return DICT_ERR; /* d->ht[0].table is NULL */
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = _dictHashKey(d, key, sdskeys);
+
+    for (table = 0; table <= 1; table++) {
+        idx = _dictOaLookup(d, &d->ht[table], key, h, sdskeys);
+        if (idx != -1) {
+            he = d->ht[table].table[idx];
+            _dictOaClearSlot(&d->ht[table], idx);
+            if (!nofree) {
+                _dictFreeEntryKey(d, he, sdskeys);
+                dictFreeEntryVal(d, he);
+            }
+            _dictFreeEntry(d, he);
+            return DICT_OK;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return DICT_ERR; /* not found */
+}
+
+/* Destroy an entire hash table */
+static int _dictOaClear(dict *d, dictht *ht)
+{
+    unsigned long i;
+
+    for (i = 0; i < ht->size && ht->used > 0; i++) {
+        dictEntry *he;
+
+        if (!_dictOaIsUsed(ht->ctrl[i])) continue;
+        he = ht->table[i];
+        _dictFreeEntryKey(d, he, _dictSdsKeys(d));
+        dictFreeEntryVal(d, he);
+        _dictFreeEntry(d, he);
+        ht->used--;
+    }
+    /* Free the table (and the control bytes allocated with it) */
+    _dictFree(ht->table);
+    _dictReset(ht);
+    return DICT_OK; /* never fails */
+}
+
+DICT_INLINE dictEntry *_dictOaFind(dict *d, const void *key, int sdskeys)
+{
+    uint64_t h;
+    long idx;
+    int table;
+
+    if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = _dictHashKey(d, key, sdskeys);
+    for (table = 0; table <= 1; table++) {
+        idx = _dictOaLookup(d, &d->ht[table], key, h, sdskeys);
+        if (idx != -1) return d->ht[table].table[idx];
+        if (!dictIsRehashing(d)) return NULL;
+    }
+    return NULL;
+}
+
+/* See _dictFindBatch(), called when the dict is not rehashing. The
+ * control bytes and the slots of the home groups are prefetched, then the
+ * first entries that may match, and then the lookups are performed. */
+DICT_INLINE void _dictOaFindBatch(dict *d, void **keys, dictEntry **entries,
+        int count, int sdskeys)
+{
+    uint64_t h[DICT_BATCH_SIZE];
+    dictht *ht = &d->ht[0];
+    unsigned long mask = _dictOaGroupMask(ht);
+    int j;
+
+    for (j = 0; j < count; j++) {
+        unsigned long base;
+
+        h[j] = _dictHashKey(d, keys[j], sdskeys);
+        base = (h[j] & mask)*DICT_OA_GROUP;
+        _dictPrefetch(ht->ctrl+base);
+        _dictPrefetch(ht->table+base);
+    }
+    for (j = 0; j < count; j++) {
+        unsigned long base = (h[j] & mask)*DICT_OA_GROUP, idx;
+        dictOaMask m = _dictOaMatch(ht->ctrl+base, _dictOaH2(h[j]));
+
+        if (!m) continue;
+        idx = base+_dictOaFirst(m);
+        if (_dictOaIsUsed(ht->ctrl[idx])) _dictPrefetch(ht->table[idx]);
+    }
+    for (j = 0; j < count; j++) {
+        long idx = _dictOaLookup(d, ht, keys[j], h[j], sdskeys);
+
+        entries[j] = (idx == -1) ? NULL : ht->table[idx];
+    }
+}
+
+/* See dictNext() */
+static dictEntry *_dictOaNext(dictIterator *iter)
+{
+    while (1) {
+        dictht *ht = &iter->d->ht[iter->table];
+
+        if (iter->index == -1 && iter->table == 0)
+            iter->d->iterators++;
+        iter->index++;
+        if (iter->index >= (long) ht->size) {
+            if (dictIsRehashing(iter->d) && iter->table == 0) {
+                iter->table++;
+                iter->index = 0;
+                ht = &iter->d->ht[1];
+            } else {
+                break;
+            }
+        }
+        if (_dictOaIsUsed(ht->ctrl[iter->index]))
+            return ht->table[iter->index];
+    }
+    return NULL;
+}
+
+/* See dictGetRandomKey() */
+static dictEntry *_dictOaGetRandomKey(dict *d)
+{
+    dictht *ht;
+    unsigned long h;
+
+    if (dictGetHashTableUsed(d) == 0) return NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    do {
+        if (dictIsRehashing(d)) {
+            /* Pick a slot in both tables. The slots of the old one
+             * already rehashed are free. */
+            h = _dictRandom() % (d->ht[0].size+d->ht[1].size);
+            ht = &d->ht[0];
+            if (h >= ht->size) {
+                h -= ht->size;
+                ht = &d->ht[1];
+            }
+        } else {
+            ht = &d->ht[0];
+            h = _dictRandom() & ht->sizemask;
+        }
+    } while(!_dictOaIsUsed(ht->ctrl[h]));
+    return ht->table[h];
+}
+
+/* Call 'fn' for the entries having 'g' as home group, see dictScan(). They
+ * are in the groups of the probe sequence of 'g', up to the first group
+ * with an empty slot, like for a lookup. */
+static void _dictOaScanGroup(dict *d, dictht *ht, unsigned long g,
+        dictScanFunction *fn, void *privdata)
+{
+    unsigned long mask = _dictOaGroupMask(ht), cur = g, step = 0, j;
+
+    while(1) {
+        unsigned long base = cur*DICT_OA_GROUP;
+
+        for (j = base; j < base+DICT_OA_GROUP; j++) {
+            if (_dictOaIsUsed(ht->ctrl[j]) &&
+                (_dictOaEntryHash(d, ht, ht->table[j]) & mask) == g)
+                fn(privdata, ht->table[j]);
+        }
+        if (_dictOaMatchEmpty(ht->ctrl+base)) break;
+        cur = (cur+(++step)) & mask;
+    }
+}
+
+static void _dictOaPrintStatsHt(dict *d, dictht *ht) {
+    unsigned long i, probes, maxprobes = 0, totprobes = 0;
+    unsigned long plvector[DICT_STATS_VECTLEN];
+    unsigned long mask = _dictOaGroupMask(ht);
+
+    if (ht->used == 0) {
+        printf("No stats available for empty dictionaries\n");
+        return;
+    }
+
+    /* For every element count the groups a lookup has to probe */
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) plvector[i] = 0;
+    for (i = 0; i < ht->size; i++) {
+        unsigned long g, step = 0;
+
+        if (!_dictOaIsUsed(ht->ctrl[i])) continue;
+        g = _dictOaEntryHash(d, ht, ht->table[i]) & mask;
+        probes = 1;
+        while(g != i/DICT_OA_GROUP) {
+            g = (g+(++step)) & mask;
+            probes++;
+        }
+        plvector[(probes < DICT_STATS_VECTLEN) ? probes : (DICT_STATS_VECTLEN-1)]++;
+        if (probes > maxprobes) maxprobes = probes;
+        totprobes += probes;
+    }
+    printf("Hash table stats (open addressing, groups of %d slots):\n",
+        DICT_OA_GROUP);
+    printf(" table size: %lu\n", ht->size);
+    printf(" number of elements: %lu\n", ht->used);
+    printf(" deleted slots: %lu\n", ht->deleted);
+    printf(" fill: %.02f%%\n", (float)ht->used*100/ht->size);
+    printf(" max groups probed: %lu\n", maxprobes);
+    printf(" avg groups probed: %.02f\n", (float)totprobes/ht->used);
+    printf(" Groups probed distribution:\n");
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) {
+        if (plvector[i] == 0) continue;
+        printf("   %s%lu: %lu (%.02f%%)\n",(i == DICT_STATS_VECTLEN-1)?">= ":"", i, plvector[i], ((float)plvector[i]/ht->used)*100);
+    }
+}
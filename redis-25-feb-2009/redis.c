@@ -15,12 +15,17 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 
 #include "ae.h"     /* Event driven programming library */
 #include "sds.h"    /* Dynamic safe strings */
 #include "anet.h"   /* Networking the easy way */
 #include "dict.h"   /* Hash tables */
 #include "adlist.h" /* Linked lists */
+#include "slab.h"   /* Small objects allocator */
 
 /* Error codes */
 #define REDIS_OK                0
@@ -29,19 +34,63 @@
 /* Static server configuration */
 #define REDIS_SERVERPORT        6379    /* TCP port */
 #define REDIS_MAXIDLETIME       (60*5)  /* default client timeout */
-#define REDIS_QUERYBUF_LEN      1024
+#define REDIS_IOBUF_LEN         (1024*16) /* minimal read(2) size */
+#define REDIS_MAX_READ_PER_EVENT (1024*64) /* read budget of a client */
+#define REDIS_QUERYBUF_MAX_FREE (1024*1024) /* shrink if more is unused */
+#define REDIS_QUERYBUF_IDLE     2       /* shrink after seconds of idle */
 #define REDIS_LOADBUF_LEN       1024
-#define REDIS_MAX_ARGS          16
+#define REDIS_INLINE_MAXLEN     1024    /* max inline query line length */
+#define REDIS_MULTIBULK_MAXARGS (1024*1024) /* max args of a request */
+#define REDIS_MULTIBULK_INITARGS 1024   /* argv allocated before the args */
+#define REDIS_BULK_MAXLEN       (1024*1024*1024) /* max bulk argument len */
+#define REDIS_ARGV_MAXKEEP      1024    /* free bigger argv on reset */
+#define REDIS_BULK_BIG_ARG      (1024*32) /* bulk args read in place */
+#define REDIS_REPLY_CHUNK_BYTES (1024*16) /* per client reply buffer */
+#define REDIS_REPLY_COPY_MAX    (1024*4) /* bigger objects are not copied */
+#ifdef IOV_MAX
+#define REDIS_WRITEV_MAX        IOV_MAX /* objects per writev(2) call */
+#else
+#define REDIS_WRITEV_MAX        16
+#endif
 #define REDIS_DEFAULT_DBNUM     16
+#define REDIS_CONFIGLINE_MAX    1024
+#define REDIS_IOTHREADS_MAX     64
+#define REDIS_TCP_BACKLOG       511     /* listen(2) backlog */
+#define REDIS_MAX_ACCEPTS_PER_CALL 1000 /* connections accepted per event */
+#define REDIS_KEY_EMBED_MAX     64      /* keys stored in the dict entry */
+#define REDIS_GET_BATCH         64      /* pipelined GETs looked up together */
+#define REDIS_SCAN_COUNT        10      /* default SCAN COUNT */
+#define REDIS_SCAN_MAX_COUNT    (1024*1024) /* bigger COUNTs are clamped */
 
 /* Hash table parameters */
 #define REDIS_HT_MINFILL        10      /* Minimal hash table fill 10% */
 #define REDIS_HT_MINSLOTS       16384   /* Never resize the HT under this */
 
+/* Threaded I/O operations */
+#define REDIS_IO_READ           0
+#define REDIS_IO_WRITE          1
+
 /* Command types */
 #define REDIS_CMD_BULK          1
 #define REDIS_CMD_INLINE        0
 
+/* Command flags, used to take decisions about a command without looking
+ * at its name */
+#define REDIS_CMD_WRITE         1       /* may modify the dataset */
+#define REDIS_CMD_READONLY      2       /* never modifies the dataset */
+#define REDIS_CMD_DENYOOM       4       /* may increase memory usage */
+#define REDIS_CMD_SLOW          8       /* O(N) or worse */
+
+/* Request types */
+#define REDIS_REQ_NONE          0       /* not known yet */
+#define REDIS_REQ_INLINE        1       /* space separated, last may be bulk */
+#define REDIS_REQ_MULTIBULK     2       /* *<argc> then $<len> arguments */
+
+/* parseQuery() return values */
+#define REDIS_PARSE_OK          0       /* a whole command is in argv */
+#define REDIS_PARSE_MORE        1       /* more data is needed */
+#define REDIS_PARSE_ERR         2       /* protocol error */
+
 /* Object types */
 #define REDIS_STRING 0
 #define REDIS_LIST 1
@@ -69,14 +118,28 @@ typedef struct redisClient {
     int fd;
     dict *dict;
     sds querybuf;
-    sds argv[REDIS_MAX_ARGS];
+    size_t qbpos;   /* offset of the unparsed part of querybuf */
+    sds *argv;
     int argc;
+    int argvlen;    /* allocated slots of argv */
+    int reqtype;    /* REDIS_REQ_* type of the request being parsed */
+    int multibulklen; /* multi bulk arguments still to parse */
     int bulklen;    /* bulk read len. -1 if not in bulk read mode */
     list *reply;
-    int sentlen;
+    int sentlen;    /* sent part of buf, or of the first reply object */
     time_t lastinteraction; /* time of the last interaction, used for timeout */
+    int pendingwrite;   /* client is in the server.pendingwrites list */
+    int pendingread;    /* client is in the server.pendingreads list */
+    int iobytes;        /* result of the last read(2)/write(2) */
+    int ioerr;          /* errno of the last failed read(2)/write(2), or 0 */
+    int sentobjs;       /* reply objects fully sent by writeReplyList() */
+    /* Small replies are copied here, sent before the reply list */
+    int bufpos;
+    char buf[REDIS_REPLY_CHUNK_BYTES];
 } redisClient;
 
+#define clientHasPendingReplies(c) ((c)->bufpos || listLength((c)->reply))
+
 /* A redis object, that is a type able to hold a string / list / set */
 typedef struct redisObject {
     int type;
@@ -95,18 +158,36 @@ struct redisServer {
     int fd;
     dict **dict;
     long long dirty;            /* changes to DB from the last save */
+    dict *commands;             /* command name -> struct redisCommand */
     list *clients;
+    list *pendingwrites;        /* clients with replies to flush before sleep */
+    list *pendingreads;         /* clients to read from using the I/O threads */
     char neterr[ANET_ERR_LEN];
     aeEventLoop *el;
     int verbosity;
     int cronloops;
     int maxidletime;
     int dbnum;
-    list *objfreelist;          /* A list of freed objects to avoid malloc() */
     int bgsaveinprogress;
     time_t lastsave;
     struct saveparam *saveparams;
     int saveparamslen;
+    FILE *logfp;                /* NULL means stdout */
+    int tcpbacklog;             /* listen(2) backlog */
+    int keyspaceoa;             /* DBs use open addressing hash tables */
+    int keyembedmax;            /* max len of keys embedded in dict entries */
+    long long stat_numconnections; /* connections accepted */
+    long long stat_rejected_conn;  /* connections failed or refused */
+    /* Threaded I/O */
+    int iothreads;              /* number of I/O threads, including main */
+    redisClient **iojobs;       /* clients to serve in the current batch */
+    int ionumjobs;              /* number of clients in iojobs */
+    int iojobslen;              /* allocated slots of iojobs */
+    int ioop;                   /* REDIS_IO_READ or REDIS_IO_WRITE */
+    unsigned long iogen;        /* incremented every time a batch starts */
+    int iopending;              /* I/O threads still serving the batch */
+    pthread_mutex_t iomutex;
+    pthread_cond_t iostart, iodone;
 };
 
 typedef void redisCommandProc(redisClient *c);
@@ -114,7 +195,8 @@ struct redisCommand {
     char *name;
     redisCommandProc *proc;
     int arity;
-    int type;
+    int type;   /* REDIS_CMD_BULK or REDIS_CMD_INLINE */
+    int flags;  /* REDIS_CMD_WRITE, REDIS_CMD_READONLY, ... */
 };
 
 struct sharedObjectsStruct {
@@ -134,12 +216,16 @@ static void addReply(redisClient *c, robj *obj);
 static void addReplySds(redisClient *c, sds s);
 static void incrRefCount(robj *o);
 static int saveDbBackground(char *filename);
+static void initIOThreads(void);
+static void populateCommandTable(void);
 
 static void pingCommand(redisClient *c);
 static void echoCommand(redisClient *c);
 static void setCommand(redisClient *c);
 static void setnxCommand(redisClient *c);
 static void getCommand(redisClient *c);
+static void mgetCommand(redisClient *c);
+static void addReplyGetEntry(redisClient *c, dictEntry *de);
 static void delCommand(redisClient *c);
 static void existsCommand(redisClient *c);
 static void incrCommand(redisClient *c);
@@ -147,6 +233,7 @@ static void decrCommand(redisClient *c);
 static void selectCommand(redisClient *c);
 static void randomkeyCommand(redisClient *c);
 static void keysCommand(redisClient *c);
+static void scanCommand(redisClient *c);
 static void dbsizeCommand(redisClient *c);
 static void lastsaveCommand(redisClient *c);
 static void saveCommand(redisClient *c);
@@ -169,37 +256,39 @@ static void ltrimCommand(redisClient *c);
 /* Global vars */
 static struct redisServer server; /* server global state */
 static struct redisCommand cmdTable[] = {
-    {"get",getCommand,2,REDIS_CMD_INLINE},
-    {"set",setCommand,3,REDIS_CMD_BULK},
-    {"setnx",setnxCommand,3,REDIS_CMD_BULK},
-    {"del",delCommand,2,REDIS_CMD_INLINE},
-    {"exists",existsCommand,2,REDIS_CMD_INLINE},
-    {"incr",incrCommand,2,REDIS_CMD_INLINE},
-    {"decr",decrCommand,2,REDIS_CMD_INLINE},
-    {"rpush",rpushCommand,3,REDIS_CMD_BULK},
-    {"lpush",lpushCommand,3,REDIS_CMD_BULK},
-    {"rpop",rpopCommand,2,REDIS_CMD_INLINE},
-    {"lpop",lpopCommand,2,REDIS_CMD_INLINE},
-    {"llen",llenCommand,2,REDIS_CMD_INLINE},
-    {"lindex",lindexCommand,3,REDIS_CMD_INLINE},
-    {"lrange",lrangeCommand,4,REDIS_CMD_INLINE},
-    {"ltrim",ltrimCommand,4,REDIS_CMD_INLINE},
-    {"randomkey",randomkeyCommand,1,REDIS_CMD_INLINE},
-    {"select",selectCommand,2,REDIS_CMD_INLINE},
-    {"move",moveCommand,3,REDIS_CMD_INLINE},
-    {"rename",renameCommand,3,REDIS_CMD_INLINE},
-    {"renamenx",renamenxCommand,3,REDIS_CMD_INLINE},
-    {"keys",keysCommand,2,REDIS_CMD_INLINE},
-    {"dbsize",dbsizeCommand,1,REDIS_CMD_INLINE},
-    {"ping",pingCommand,1,REDIS_CMD_INLINE},
-    {"echo",echoCommand,2,REDIS_CMD_BULK},
-    {"save",saveCommand,1,REDIS_CMD_INLINE},
-    {"bgsave",bgsaveCommand,1,REDIS_CMD_INLINE},
-    {"shutdown",shutdownCommand,1,REDIS_CMD_INLINE},
-    {"lastsave",lastsaveCommand,1,REDIS_CMD_INLINE},
+    {"get",getCommand,2,REDIS_CMD_INLINE,REDIS_CMD_READONLY},
+    {"mget",mgetCommand,-2,REDIS_CMD_INLINE,REDIS_CMD_READONLY},
+    {"set",setCommand,3,REDIS_CMD_BULK,REDIS_CMD_WRITE|REDIS_CMD_DENYOOM},
+    {"setnx",setnxCommand,3,REDIS_CMD_BULK,REDIS_CMD_WRITE|REDIS_CMD_DENYOOM},
+    {"del",delCommand,2,REDIS_CMD_INLINE,REDIS_CMD_WRITE},
+    {"exists",existsCommand,2,REDIS_CMD_INLINE,REDIS_CMD_READONLY},
+    {"incr",incrCommand,2,REDIS_CMD_INLINE,REDIS_CMD_WRITE|REDIS_CMD_DENYOOM},
+    {"decr",decrCommand,2,REDIS_CMD_INLINE,REDIS_CMD_WRITE|REDIS_CMD_DENYOOM},
+    {"rpush",rpushCommand,3,REDIS_CMD_BULK,REDIS_CMD_WRITE|REDIS_CMD_DENYOOM},
+    {"lpush",lpushCommand,3,REDIS_CMD_BULK,REDIS_CMD_WRITE|REDIS_CMD_DENYOOM},
+    {"rpop",rpopCommand,2,REDIS_CMD_INLINE,REDIS_CMD_WRITE},
+    {"lpop",lpopCommand,2,REDIS_CMD_INLINE,REDIS_CMD_WRITE},
+    {"llen",llenCommand,2,REDIS_CMD_INLINE,REDIS_CMD_READONLY},
+    {"lindex",lindexCommand,3,REDIS_CMD_INLINE,REDIS_CMD_READONLY},
+    {"lrange",lrangeCommand,4,REDIS_CMD_INLINE,REDIS_CMD_READONLY|REDIS_CMD_SLOW},
+    {"ltrim",ltrimCommand,4,REDIS_CMD_INLINE,REDIS_CMD_WRITE|REDIS_CMD_SLOW},
+    {"randomkey",randomkeyCommand,1,REDIS_CMD_INLINE,REDIS_CMD_READONLY},
+    {"select",selectCommand,2,REDIS_CMD_INLINE,0},
+    {"move",moveCommand,3,REDIS_CMD_INLINE,REDIS_CMD_WRITE},
+    {"rename",renameCommand,3,REDIS_CMD_INLINE,REDIS_CMD_WRITE},
+    {"renamenx",renamenxCommand,3,REDIS_CMD_INLINE,REDIS_CMD_WRITE},
+    {"keys",keysCommand,2,REDIS_CMD_INLINE,REDIS_CMD_READONLY|REDIS_CMD_SLOW},
+    {"scan",scanCommand,-2,REDIS_CMD_INLINE,REDIS_CMD_READONLY},
+    {"dbsize",dbsizeCommand,1,REDIS_CMD_INLINE,REDIS_CMD_READONLY},
+    {"ping",pingCommand,1,REDIS_CMD_INLINE,0},
+    {"echo",echoCommand,2,REDIS_CMD_BULK,0},
+    {"save",saveCommand,1,REDIS_CMD_INLINE,REDIS_CMD_SLOW},
+    {"bgsave",bgsaveCommand,1,REDIS_CMD_INLINE,0},
+    {"shutdown",shutdownCommand,1,REDIS_CMD_INLINE,REDIS_CMD_SLOW},
+    {"lastsave",lastsaveCommand,1,REDIS_CMD_INLINE,0},
     /* lpop, rpop, lindex, llen */
     /* dirty, lastsave, info */
-    {"",NULL,0,0}
+    {NULL,NULL,0,0,0}
 };
 
 /*============================ Utility functions ============================ */
@@ -334,10 +423,12 @@ void redisLog(int level, const char *fmt, ...)
     va_start(ap, fmt);
     if (level >= server.verbosity) {
         char *c = ".-*";
-        fprintf(stdout,"%c ",c[level]);
-        vfprintf(stdout, fmt, ap);
-        fprintf(stdout,"\n");
-        fflush(stdout);
+        FILE *fp = server.logfp ? server.logfp : stdout;
+
+        fprintf(fp,"%c ",c[level]);
+        vfprintf(fp, fmt, ap);
+        fprintf(fp,"\n");
+        fflush(fp);
     }
     va_end(ap);
 }
@@ -348,7 +439,7 @@ void redisLog(int level, const char *fmt, ...)
  * keys and radis objects as values (objects can hold SDS strings,
  * lists, sets). */
 
-static unsigned int sdsDictHashFunction(const void *key) {
+static uint64_t sdsDictHashFunction(const void *key) {
     return dictGenHashFunction(key, sdslen((sds)key));
 }
 
@@ -378,6 +469,23 @@ static void sdsDictValDestructor(void *privdata, void *val)
     decrRefCount(val);
 }
 
+/* Short keys are stored in the same allocation of the hash entry: one
+ * malloc() and one cache miss less per key. */
+static size_t sdsDictKeyEmbedLen(void *privdata, const void *key)
+{
+    size_t len = sdslen((sds)key);
+    DICT_NOTUSED(privdata);
+
+    return (len <= (size_t)server.keyembedmax) ? sdsAllocLen(len) : 0;
+}
+
+static void *sdsDictKeyEmbed(void *privdata, void *buf, const void *key)
+{
+    DICT_NOTUSED(privdata);
+
+    return sdsnewlenInPlace(buf,key,sdslen((sds)key));
+}
+
 dictType sdsDictType = {
     sdsDictHashFunction,       /* hash function */
     NULL,                      /* key dup */
@@ -385,6 +493,39 @@ dictType sdsDictType = {
     sdsDictKeyCompare,         /* key compare */
     sdsDictKeyDestructor,      /* key destructor */
     sdsDictValDestructor,      /* val destructor */
+    sdsDictKeyEmbedLen,        /* key embedded len */
+    sdsDictKeyEmbed,           /* key embed */
+    DICT_TYPE_SDS_KEYS         /* flags */
+};
+
+/* Case insensitive sds keys, used for the command table. The values are
+ * static struct redisCommand entries, not to be freed. */
+static uint64_t sdsDictCaseHashFunction(const void *key) {
+    return dictGenCaseHashFunction(key, sdslen((sds)key));
+}
+
+static int sdsDictKeyCaseCompare(void *privdata, const void *key1,
+        const void *key2)
+{
+    int l1,l2;
+    DICT_NOTUSED(privdata);
+
+    l1 = sdslen((sds)key1);
+    l2 = sdslen((sds)key2);
+    if (l1 != l2) return 0;
+    return strncasecmp(key1, key2, l1) == 0;
+}
+
+dictType commandTableDictType = {
+    sdsDictCaseHashFunction,   /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    sdsDictKeyCaseCompare,     /* key compare */
+    sdsDictKeyDestructor,      /* key destructor */
+    NULL,                      /* val destructor */
+    NULL,                      /* key embedded len */
+    NULL,                      /* key embed */
+    0                          /* flags */
 };
 
 /* ========================= Random utility functions ======================= */
@@ -420,8 +561,47 @@ void closeTimedoutClients(void) {
     listReleaseIterator(li);
 }
 
+/* Reads go directly into the spare space of the query buffer, so after a
+ * big request, or just after the first read, the buffer may hold a lot of
+ * unused memory. Release it for the idle clients, and for the clients
+ * that are leaving most of a big buffer unused. */
+void shrinkQueryBuffers(void) {
+    redisClient *c;
+    listIter *li;
+    listNode *ln;
+    time_t now = time(NULL);
+
+    li = listGetIterator(server.clients,AL_START_HEAD);
+    if (!li) return;
+    while ((ln = listNextElement(li)) != NULL) {
+        size_t avail;
+
+        c = listNodeValue(ln);
+        avail = sdsavail(c->querybuf);
+        if ((avail && now - c->lastinteraction >= REDIS_QUERYBUF_IDLE) ||
+            (avail > REDIS_QUERYBUF_MAX_FREE && avail > sdslen(c->querybuf)))
+            c->querybuf = sdsRemoveFreeSpace(c->querybuf);
+    }
+    listReleaseIterator(li);
+}
+
+/* Log the memory used by the slab allocator size classes in use */
+static void logSlabStats(void) {
+    slabStats st;
+    int j;
+
+    for (j = 0; j < SLAB_CLASSES; j++) {
+        slabGetStats(j,&st);
+        if (st.slabs == 0) continue;
+        redisLog(REDIS_DEBUG,"Slab class %d bytes: %lu objects in %lu slabs "
+            "(%lu empty), %.2f%% used", (int)st.size, st.used, st.slabs,
+            st.empty, (float)st.used*100/st.capacity);
+    }
+}
+
 int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
-    int j, size, used, loops = server.cronloops++;
+    int j, loops = server.cronloops++;
+    unsigned long size, used;
     REDIS_NOTUSED(eventLoop);
     REDIS_NOTUSED(id);
     REDIS_NOTUSED(clientData);
@@ -432,23 +612,34 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         size = dictGetHashTableSize(server.dict[j]);
         used = dictGetHashTableUsed(server.dict[j]);
         if (!(loops % 5) && used > 0) {
-            redisLog(REDIS_DEBUG,"DB %d: %d keys in %d slots HT.",j,used,size);
+            redisLog(REDIS_DEBUG,"DB %d: %lu keys in %lu slots HT.",j,used,size);
             // dictPrintStats(server.dict);
         }
         if (size && used && size > REDIS_HT_MINSLOTS &&
-            (used*100/size < REDIS_HT_MINFILL)) {
+            (used*100/size < REDIS_HT_MINFILL) &&
+            !dictIsRehashing(server.dict[j])) {
             redisLog(REDIS_NOTICE,"The hash table %d is too sparse, resize it...",j);
             dictResize(server.dict[j]);
-            redisLog(REDIS_NOTICE,"Hash table %d resized.",j);
         }
+        /* Help the incremental rehashing of the DBs that are not accessed
+         * often enough to migrate by themselves, without blocking the
+         * server for more than a millisecond per DB. */
+        if (dictIsRehashing(server.dict[j]))
+            dictRehashMilliseconds(server.dict[j],1);
     }
 
     /* Show information about connected clients */
-    if (!(loops % 5)) redisLog(REDIS_DEBUG,"%d clients connected",listLength(server.clients));
+    if (!(loops % 5)) {
+        redisLog(REDIS_DEBUG,"%d clients connected (%lld accepted, %lld rejected)",
+            listLength(server.clients), server.stat_numconnections,
+            server.stat_rejected_conn);
+        logSlabStats();
+    }
 
     /* Close connections of timedout clients */
     if (!(loops % 10))
         closeTimedoutClients();
+    shrinkQueryBuffers();
 
     /* Check if a background saving in progress terminated */
     if (server.bgsaveinprogress) {
@@ -504,49 +695,225 @@ static void appendServerSaveParams(time_t seconds, int changes) {
     server.saveparamslen++;
 }
 
+static void resetServerSaveParams(void) {
+    free(server.saveparams);
+    server.saveparams = NULL;
+    server.saveparamslen = 0;
+}
+
+/* Default values of the parameters that can be changed by the config
+ * file. Must be called before loadServerConfig() and initServer(). */
+static void initServerConfig() {
+    server.dbnum = REDIS_DEFAULT_DBNUM;
+    server.port = REDIS_SERVERPORT;
+    server.verbosity = REDIS_DEBUG;
+    server.maxidletime = REDIS_MAXIDLETIME;
+    server.saveparams = NULL;
+    server.saveparamslen = 0;
+    server.logfp = NULL; /* NULL = log on standard output */
+    server.iothreads = 1;  /* 1 = no threaded I/O */
+    server.tcpbacklog = REDIS_TCP_BACKLOG;
+    server.keyspaceoa = 0;
+    server.keyembedmax = REDIS_KEY_EMBED_MAX;
+    appendServerSaveParams(60*60,1);  /* save after 1 hour and 1 change */
+    appendServerSaveParams(300,100);  /* save after 5 minutes and 100 changes */
+    appendServerSaveParams(60,10000); /* save after 1 minute and 10000 changes */
+}
+
+/* Seed for the hash function of the dictionaries, so that the distribution
+ * of keys in buckets changes at every restart and can't be attacked. */
+static uint32_t getHashSeed(void) {
+    uint32_t seed;
+    struct timeval tv;
+    FILE *fp = fopen("/dev/urandom","r");
+
+    if (fp) {
+        size_t nread = fread(&seed,sizeof(seed),1,fp);
+
+        fclose(fp);
+        if (nread == 1) return seed;
+    }
+    gettimeofday(&tv,NULL);
+    return (uint32_t)(tv.tv_sec ^ tv.tv_usec ^ (getpid() << 16));
+}
+
 static void initServer() {
     int j;
 
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
 
-    server.dbnum = REDIS_DEFAULT_DBNUM;
-    server.port = REDIS_SERVERPORT;
+    dictSetHashFunctionSeed(getHashSeed());
+    server.commands = dictCreate(&commandTableDictType,NULL);
     server.clients = listCreate();
-    server.objfreelist = listCreate();
+    server.pendingwrites = listCreate();
+    server.pendingreads = listCreate();
     createSharedObjects();
     server.el = aeCreateEventLoop();
     server.dict = malloc(sizeof(dict*)*server.dbnum);
-    if (!server.dict || !server.clients || !server.el || !server.objfreelist)
+    if (!server.dict || !server.commands || !server.clients ||
+        !server.pendingwrites || !server.pendingreads || !server.el)
         oom("server initialization"); /* Fatal OOM */
-    server.fd = anetTcpServer(server.neterr, server.port, NULL);
+    populateCommandTable();
+    server.fd = anetTcpServer(server.neterr, server.port, NULL,
+        server.tcpbacklog);
     if (server.fd == -1) {
         redisLog(REDIS_WARNING, "Opening TCP port: %s", server.neterr);
         exit(1);
     }
+    /* acceptHandler() accepts until the queue is empty */
+    anetNonBlock(NULL,server.fd);
     for (j = 0; j < server.dbnum; j++) {
-        server.dict[j] = dictCreate(&sdsDictType,NULL);
+        server.dict[j] = server.keyspaceoa ?
+            dictCreateOpenAddressing(&sdsDictType,NULL) :
+            dictCreate(&sdsDictType,NULL);
         if (!server.dict[j])
             oom("server initialization"); /* Fatal OOM */
     }
-    server.verbosity = REDIS_DEBUG;
     server.cronloops = 0;
-    server.maxidletime = REDIS_MAXIDLETIME;
     server.bgsaveinprogress = 0;
     server.lastsave = time(NULL);
     server.dirty = 0;
-    server.saveparams = NULL;
-    server.saveparamslen = 0;
-    appendServerSaveParams(60*60,1);
-    appendServerSaveParams(300,100);
-    appendServerSaveParams(60,10000);
+    server.stat_numconnections = 0;
+    server.stat_rejected_conn = 0;
+    server.iojobs = NULL;
+    server.ionumjobs = 0;
+    server.iojobslen = 0;
+    initIOThreads();
     aeCreateTimeEvent(server.el, 1000, serverCron, NULL, NULL);
-    redisLog(REDIS_NOTICE,"Server started");
+    redisLog(REDIS_NOTICE,"Server started, using the %s event loop",
+        aeGetApiName());
     if (loadDb("dump.rdb") == REDIS_OK)
         redisLog(REDIS_NOTICE,"DB loaded from disk");
     serverCron(NULL,0,NULL);
 }
 
+/* I agree, this is a very rudimental way to load a configuration...
+   will improve later if the config gets more complex */
+static void loadServerConfig(char *filename) {
+    FILE *fp = fopen(filename,"r");
+    char buf[REDIS_CONFIGLINE_MAX+1], *err = NULL;
+    int linenum = 0, saveseen = 0;
+    sds line = NULL;
+
+    if (!fp) {
+        redisLog(REDIS_WARNING,"Fatal error, can't open config file '%s'",
+            filename);
+        exit(1);
+    }
+    while(fgets(buf,REDIS_CONFIGLINE_MAX+1,fp) != NULL) {
+        sds *argv;
+        int argc, j;
+
+        linenum++;
+        line = sdsnew(buf);
+        line = sdstrim(line," \t\r\n");
+
+        /* Skip comments and blank lines*/
+        if (line[0] == '#' || line[0] == '\0') {
+            sdsfree(line);
+            continue;
+        }
+
+        /* Split into arguments */
+        argv = sdssplitlen(line,sdslen(line)," ",1,&argc);
+        if (argv == NULL) oom("Splitting config line in tokens");
+        sdstolower(argv[0]);
+
+        /* Execute config directives */
+        if (!strcmp(argv[0],"timeout") && argc == 2) {
+            server.maxidletime = atoi(argv[1]);
+            if (server.maxidletime < 1) {
+                err = "Invalid timeout value"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"port") && argc == 2) {
+            server.port = atoi(argv[1]);
+            if (server.port < 1 || server.port > 65535) {
+                err = "Invalid port"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"save") && argc == 3) {
+            int seconds = atoi(argv[1]);
+            int changes = atoi(argv[2]);
+            if (seconds < 1 || changes < 0) {
+                err = "Invalid save parameters"; goto loaderr;
+            }
+            /* The first save line replaces the default save points */
+            if (!saveseen++) resetServerSaveParams();
+            appendServerSaveParams(seconds,changes);
+        } else if (!strcmp(argv[0],"dir") && argc == 2) {
+            if (chdir(argv[1]) == -1) {
+                redisLog(REDIS_WARNING,"Can't chdir to '%s': %s",
+                    argv[1], strerror(errno));
+                exit(1);
+            }
+        } else if (!strcmp(argv[0],"loglevel") && argc == 2) {
+            if (!strcmp(argv[1],"debug")) server.verbosity = REDIS_DEBUG;
+            else if (!strcmp(argv[1],"notice")) server.verbosity = REDIS_NOTICE;
+            else if (!strcmp(argv[1],"warning")) server.verbosity = REDIS_WARNING;
+            else {
+                err = "Invalid log level. Must be one of debug, notice, warning";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"logfile") && argc == 2) {
+            if (server.logfp) fclose(server.logfp);
+            server.logfp = NULL;
+            if (strcmp(argv[1],"stdout")) {
+                /* Open the file once here: the server would not be able
+                 * to abort just for this problem later... */
+                server.logfp = fopen(argv[1],"a");
+                if (server.logfp == NULL) {
+                    err = sdscatprintf(sdsempty(),
+                        "Can't open the log file: %s", strerror(errno));
+                    goto loaderr;
+                }
+            }
+        } else if (!strcmp(argv[0],"databases") && argc == 2) {
+            server.dbnum = atoi(argv[1]);
+            if (server.dbnum < 1) {
+                err = "Invalid number of databases"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"tcp-backlog") && argc == 2) {
+            server.tcpbacklog = atoi(argv[1]);
+            if (server.tcpbacklog < 1) {
+                err = "Invalid backlog value"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"keyspace-encoding") && argc == 2) {
+            if (!strcmp(argv[1],"chaining")) server.keyspaceoa = 0;
+            else if (!strcmp(argv[1],"open-addressing")) server.keyspaceoa = 1;
+            else {
+                err = "Invalid key space encoding. Must be one of chaining, open-addressing";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"key-embed-max") && argc == 2) {
+            server.keyembedmax = atoi(argv[1]);
+            if (server.keyembedmax < 0) {
+                err = "Invalid key-embed-max value"; goto loaderr;
+            }
+        } else if (!strcmp(argv[0],"io-threads") && argc == 2) {
+            server.iothreads = atoi(argv[1]);
+            if (server.iothreads < 1 ||
+                server.iothreads > REDIS_IOTHREADS_MAX) {
+                err = "Invalid number of I/O threads"; goto loaderr;
+            }
+        } else {
+            err = "Bad directive or wrong number of arguments"; goto loaderr;
+        }
+        for (j = 0; j < argc; j++)
+            sdsfree(argv[j]);
+        free(argv);
+        sdsfree(line);
+    }
+    fclose(fp);
+    return;
+
+loaderr:
+    fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
+    fprintf(stderr, "Reading the configuration file, at line %d\n", linenum);
+    fprintf(stderr, ">>> '%s'\n", line);
+    fprintf(stderr, "%s\n", err);
+    exit(1);
+}
+
 static void freeClientArgv(redisClient *c) {
     int j;
 
@@ -555,6 +922,28 @@ static void freeClientArgv(redisClient *c) {
     c->argc = 0;
 }
 
+/* Make sure there is room for 'count' arguments in c->argv */
+static void clientArgvMakeRoom(redisClient *c, int count) {
+    if (c->argvlen >= count) return;
+    c->argv = realloc(c->argv,sizeof(sds)*count);
+    if (c->argv == NULL) oom("clientArgvMakeRoom");
+    c->argvlen = count;
+}
+
+/* Remove a client flagged as pending from the list 'l', or from the
+ * I/O batch currently being served if it was already moved there. */
+static void unlinkPendingClient(list *l, redisClient *c) {
+    listNode *ln = listSearchKey(l,c);
+    int j;
+
+    if (ln) {
+        listDelNode(l,ln);
+        return;
+    }
+    for (j = 0; j < server.ionumjobs; j++)
+        if (server.iojobs[j] == c) server.iojobs[j] = NULL;
+}
+
 static void freeClient(redisClient *c) {
     listNode *ln;
 
@@ -563,69 +952,208 @@ static void freeClient(redisClient *c) {
     sdsfree(c->querybuf);
     listRelease(c->reply);
     freeClientArgv(c);
+    free(c->argv);
     close(c->fd);
     ln = listSearchKey(server.clients,c);
     assert(ln != NULL);
     listDelNode(server.clients,ln);
+    if (c->pendingwrite) unlinkPendingClient(server.pendingwrites,c);
+    if (c->pendingread) unlinkPendingClient(server.pendingreads,c);
     free(c);
 }
 
-static void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    redisClient *c = privdata;
-    int nwritten = 0, totwritten = 0, objlen;
-    robj *o;
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
-
-    while(listLength(c->reply)) {
-        o = listNodeValue(listFirst(c->reply));
-        objlen = sdslen(o->ptr);
+/* Write as much as possible of the client reply buffer and reply list to
+ * the socket. Everything is sent with writev(2), up to REDIS_WRITEV_MAX
+ * objects per call, so a reply made of many objects (e.g. the length, the
+ * value and the CRLF of a bulk reply) costs a single syscall, and the
+ * values are not copied. c->sentlen is the part of the buffer already
+ * sent, or of the first object once the buffer is empty.
+ *
+ * Nothing is released here: the number of objects fully transmitted is
+ * stored in c->sentobjs and the result of the last writev(2) in c->iobytes
+ * and c->ioerr. This makes the function safe to call from the I/O threads,
+ * as reply objects may be shared and their refcount is not protected by
+ * any lock. afterWriteToClient() does the rest in the main thread. */
+static void writeReplyList(redisClient *c) {
+    struct iovec iov[REDIS_WRITEV_MAX];
+    listNode *ln = listFirst(c->reply), *next;
+    int nwritten = 0, totwritten = 0;
+
+    c->sentobjs = 0;
+    while(c->bufpos || ln) {
+        size_t towrite = 0, left;
+        int iovcnt = 0, objlen;
+        robj *o;
 
-        if (objlen == 0) {
-            listDelNode(c->reply,listFirst(c->reply));
-            continue;
+        /* Fill the iovec with the buffer and the objects still to send */
+        if (c->bufpos) {
+            iov[0].iov_base = c->buf+c->sentlen;
+            iov[0].iov_len = c->bufpos-c->sentlen;
+            towrite += iov[0].iov_len;
+            iovcnt++;
+        }
+        for (next = ln; next && iovcnt < REDIS_WRITEV_MAX;
+             next = listNextNode(next))
+        {
+            int offset = (next == ln && !c->bufpos) ? c->sentlen : 0;
+
+            o = listNodeValue(next);
+            objlen = sdslen(o->ptr) - offset;
+            if (objlen == 0) continue;
+            iov[iovcnt].iov_base = ((char*)o->ptr) + offset;
+            iov[iovcnt].iov_len = objlen;
+            towrite += objlen;
+            iovcnt++;
+        }
+        if (iovcnt) {
+            nwritten = writev(c->fd, iov, iovcnt);
+            if (nwritten <= 0) break;
+            totwritten += nwritten;
+        } else {
+            nwritten = 0; /* Just empty objects left */
         }
 
-        nwritten = write(fd, o->ptr+c->sentlen, objlen - c->sentlen);
-        if (nwritten <= 0) break;
-        c->sentlen += nwritten;
-        totwritten += nwritten;
-        /* If we fully sent the object on head go to the next one */
-        if (c->sentlen == objlen) {
-            listDelNode(c->reply,listFirst(c->reply));
+        /* Account for the buffer, then skip the objects fully sent */
+        left = nwritten;
+        if (c->bufpos) {
+            if (left < (size_t)(c->bufpos-c->sentlen)) {
+                c->sentlen += left;
+                break;
+            }
+            left -= c->bufpos-c->sentlen;
+            c->bufpos = 0;
             c->sentlen = 0;
         }
-    }
-    if (nwritten == -1) {
-        if (errno == EAGAIN) {
-            nwritten = 0;
-        } else {
-            redisLog(REDIS_DEBUG,
-                "Error writing to client: %s", strerror(errno));
-            freeClient(c);
-            return;
+        while(ln) {
+            o = listNodeValue(ln);
+            objlen = sdslen(o->ptr) - c->sentlen;
+            if (left < (size_t)objlen) {
+                c->sentlen += left;
+                break;
+            }
+            left -= objlen;
+            c->sentlen = 0;
+            c->sentobjs++;
+            ln = listNextNode(ln);
         }
+        if ((size_t)nwritten < towrite) break; /* Socket buffer full */
     }
-    if (totwritten > 0) c->lastinteraction = time(NULL);
-    if (listLength(c->reply) == 0) {
-        c->sentlen = 0;
-        aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+    c->ioerr = (nwritten == -1 && errno != EAGAIN) ? errno : 0;
+    c->iobytes = totwritten;
+}
+
+/* Release the reply objects sent by writeReplyList() and handle write
+ * errors. Returns REDIS_ERR if the client was freed. */
+static int afterWriteToClient(redisClient *c) {
+    int j;
+
+    for (j = 0; j < c->sentobjs; j++)
+        listDelNode(c->reply,listFirst(c->reply));
+    c->sentobjs = 0;
+    if (c->ioerr) {
+        redisLog(REDIS_DEBUG,
+            "Error writing to client: %s", strerror(c->ioerr));
+        freeClient(c);
+        return REDIS_ERR;
     }
+    if (c->iobytes > 0) c->lastinteraction = time(NULL);
+    return REDIS_OK;
+}
+
+/* Write as much as possible of the client reply list to the socket.
+ * Returns REDIS_ERR if the client was freed because of a write error. */
+static int writeToClient(redisClient *c) {
+    writeReplyList(c);
+    return afterWriteToClient(c);
 }
 
-static struct redisCommand *lookupCommand(char *name) {
-    int j = 0;
-    while(cmdTable[j].name != NULL) {
-        if (!strcmp(name,cmdTable[j].name)) return &cmdTable[j];
-        j++;
+static void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    redisClient *c = privdata;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+
+    if (writeToClient(c) == REDIS_ERR) return;
+    if (!clientHasPendingReplies(c))
+        aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+}
+
+static struct redisCommand *lookupCommand(sds name) {
+    dictEntry *de = dictFind(server.commands,name);
+
+    return de ? dictGetEntryVal(de) : NULL;
+}
+
+/* Fill the server.commands hash table from cmdTable */
+static void populateCommandTable(void) {
+    int j;
+
+    for (j = 0; cmdTable[j].name != NULL; j++) {
+        if (dictAdd(server.commands,sdsnew(cmdTable[j].name),
+                    &cmdTable[j]) != DICT_OK)
+            oom("populateCommandTable");
     }
-    return NULL;
 }
 
 /* resetClient prepare the client to process the next command */
 static void resetClient(redisClient *c) {
     freeClientArgv(c);
+    c->reqtype = REDIS_REQ_NONE;
+    c->multibulklen = 0;
     c->bulklen = -1;
+    /* Don't keep the memory of a huge multi bulk request around */
+    if (c->argvlen > REDIS_ARGV_MAXKEEP) {
+        free(c->argv);
+        c->argv = NULL;
+        c->argvlen = 0;
+    }
+}
+
+/* Make room in the query buffer for more of the big bulk argument read in
+ * place. The buffer is enlarged by what was already received, at least
+ * REDIS_BULK_BIG_ARG bytes, and never beyond the argument: the announced
+ * length alone can't make us allocate up to REDIS_BULK_MAXLEN bytes, the
+ * memory grows with the data actually sent. */
+static void growBulkArgument(redisClient *c) {
+    size_t qblen = sdslen(c->querybuf), missing = c->bulklen-qblen;
+    size_t grow = (qblen > REDIS_BULK_BIG_ARG) ? qblen : REDIS_BULK_BIG_ARG;
+
+    if (sdsavail(c->querybuf) > 0) return;
+    c->querybuf = sdsMakeRoomForNonGreedy(c->querybuf,
+        (grow < missing) ? grow : missing);
+}
+
+/* Called when the length of the next bulk argument is known. If it is big
+ * and not yet fully received, the query buffer is trimmed so that it starts
+ * with the argument: readFromClient() will read the argument in place,
+ * enlarging the buffer with growBulkArgument(), and takeBulkArgument() can
+ * then use the query buffer itself as argument, without copying the
+ * data. */
+static void prepareBulkArgument(redisClient *c) {
+    if (c->bulklen < REDIS_BULK_BIG_ARG ||
+        (signed)(sdslen(c->querybuf)-c->qbpos) >= c->bulklen) return;
+    if (c->qbpos) {
+        c->querybuf = sdsrange(c->querybuf,c->qbpos,-1);
+        c->qbpos = 0;
+    }
+}
+
+/* Return the bulk argument of c->bulklen bytes (CRLF included) at the
+ * start of the unparsed part of the query buffer. */
+static sds takeBulkArgument(redisClient *c) {
+    sds arg;
+
+    if (c->qbpos == 0 && c->bulklen >= REDIS_BULK_BIG_ARG &&
+        (signed)sdslen(c->querybuf) == c->bulklen)
+    {
+        /* The buffer holds just the argument: use it, dropping the CRLF */
+        arg = sdsrange(c->querybuf,0,c->bulklen-3);
+        c->querybuf = sdsempty();
+    } else {
+        arg = sdsnewlen(c->querybuf+c->qbpos,c->bulklen-2);
+        c->qbpos += c->bulklen;
+    }
+    return arg;
 }
 
 /* If this function gets called we already read a whole
@@ -639,10 +1167,9 @@ static void resetClient(redisClient *c) {
 static int processCommand(redisClient *c) {
     struct redisCommand *cmd;
 
-    sdstolower(c->argv[0]);
     /* The QUIT command is handled as a special case. Normal command
      * procs are unable to close the client connection safely */
-    if (!strcmp(c->argv[0],"quit")) {
+    if (!strcasecmp(c->argv[0],"quit")) {
         freeClient(c);
         return 0;
     }
@@ -651,15 +1178,21 @@ static int processCommand(redisClient *c) {
         addReplySds(c,sdsnew("-ERR unknown command\r\n"));
         resetClient(c);
         return 1;
-    } else if (cmd->arity != c->argc) {
+    } else if ((cmd->arity > 0 && cmd->arity != c->argc) ||
+               (c->argc < -cmd->arity)) {
+        /* A negative arity means at least -arity arguments */
         addReplySds(c,sdsnew("-ERR wrong number of arguments\r\n"));
         resetClient(c);
         return 1;
-    } else if (cmd->type == REDIS_CMD_BULK && c->bulklen == -1) {
+    } else if (cmd->type == REDIS_CMD_BULK && c->bulklen == -1 &&
+               c->reqtype == REDIS_REQ_INLINE) {
+        /* Inline request: the last argument is the length of the bulk
+         * data following the command line. Multi bulk requests already
+         * have all the arguments. */
         int bulklen = atoi(c->argv[c->argc-1]);
 
         sdsfree(c->argv[c->argc-1]);
-        if (bulklen < 0 || bulklen > 1024*1024*1024) {
+        if (bulklen < 0 || bulklen > REDIS_BULK_MAXLEN) {
             c->argc--;
             c->argv[c->argc] = NULL;
             addReplySds(c,sdsnew("-ERR invalid bulk write count\r\n"));
@@ -671,11 +1204,11 @@ static int processCommand(redisClient *c) {
         c->bulklen = bulklen+2; /* add two bytes for CR+LF */
         /* It is possible that the bulk read is already in the
          * buffer. Check this condition and handle it accordingly */
-        if ((signed)sdslen(c->querybuf) >= c->bulklen) {
-            c->argv[c->argc] = sdsnewlen(c->querybuf,c->bulklen-2);
+        if ((signed)(sdslen(c->querybuf)-c->qbpos) >= c->bulklen) {
+            c->argv[c->argc] = takeBulkArgument(c);
             c->argc++;
-            c->querybuf = sdsrange(c->querybuf,c->bulklen,-1);
         } else {
+            prepareBulkArgument(c);
             return 1;
         }
     }
@@ -685,98 +1218,457 @@ static int processCommand(redisClient *c) {
     return 1;
 }
 
-static void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    redisClient *c = (redisClient*) privdata;
-    char buf[REDIS_QUERYBUF_LEN];
-    int nread;
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
-
-    nread = read(fd, buf, REDIS_QUERYBUF_LEN);
-    if (nread == -1) {
-        if (errno == EAGAIN) {
-            nread = 0;
+/* Read from the client socket appending data to the query buffer. Like
+ * writeReplyList() the outcome is just stored in c->iobytes and c->ioerr
+ * so that the I/O threads can call it, handleReadResult() takes care of
+ * errors in the main thread.
+ *
+ * Data is read directly into the free space of the query buffer, at least
+ * REDIS_IOBUF_LEN bytes at a time, or as much of the missing part of the
+ * bulk argument being received as the buffer can take. We read until the
+ * socket is drained or REDIS_MAX_READ_PER_EVENT bytes are read (unless
+ * more are needed to complete the bulk argument), so that a client sending
+ * a big pipeline can't starve the others. A big bulk argument prepared by
+ * prepareBulkArgument() is read alone, so the buffer will contain just it. */
+static void readFromClient(redisClient *c) {
+    size_t budget = REDIS_MAX_READ_PER_EVENT, total = 0;
+    int nread = 0;
+
+    if (c->bulklen != -1 &&
+        c->bulklen - (signed)(sdslen(c->querybuf)-c->qbpos) > (signed)budget)
+        budget = c->bulklen - (sdslen(c->querybuf)-c->qbpos);
+    while(total < budget) {
+        size_t readlen = REDIS_IOBUF_LEN, qblen = sdslen(c->querybuf);
+        int missing = c->bulklen - (signed)(qblen-c->qbpos);
+
+        int inplace = c->bulklen >= REDIS_BULK_BIG_ARG && c->qbpos == 0 &&
+                      missing > 0;
+
+        if (inplace) {
+            growBulkArgument(c);
+            readlen = sdsavail(c->querybuf);
+            if ((signed)readlen > missing) readlen = missing;
         } else {
-            redisLog(REDIS_DEBUG, "Reading from client: %s",strerror(errno));
-            freeClient(c);
-            return;
+            if (c->bulklen != -1 && missing > (signed)readlen)
+                readlen = missing;
+            c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
+            readlen = sdsavail(c->querybuf);
         }
-    } else if (nread == 0) {
-        redisLog(REDIS_DEBUG, "Client closed connection");
-        freeClient(c);
-        return;
+        nread = read(c->fd, c->querybuf+qblen, readlen);
+        if (nread <= 0) break;
+        sdsIncrLen(c->querybuf, nread);
+        total += nread;
+        if ((size_t)nread < readlen) break; /* Nothing more to read */
+        if (inplace && nread == missing) break; /* Argument complete */
     }
-    if (nread) {
-        c->querybuf = sdscatlen(c->querybuf, buf, nread);
+    if (total) {
+        /* Errors and EOF will be reported by the next read */
+        c->ioerr = 0;
+        c->iobytes = total;
         c->lastinteraction = time(NULL);
     } else {
-        return;
+        c->ioerr = (nread == -1) ? errno : 0;
+        c->iobytes = nread;
     }
+}
 
-again:
-    if (c->bulklen == -1) {
-        /* Read the first line of the query */
-        char *p = strchr(c->querybuf,'\n');
-        size_t querylen;
-        if (p) {
-            sds query, *argv;
-            int argc, j;
-            
-            query = c->querybuf;
-            c->querybuf = sdsempty();
-            querylen = 1+(p-(query));
-            if (sdslen(query) > querylen) {
-                /* leave data after the first line of the query in the buffer */
-                c->querybuf = sdscatlen(c->querybuf,query+querylen,sdslen(query)-querylen);
-            }
-            *p = '\0'; /* remove "\n" */
-            if (*(p-1) == '\r') *(p-1) = '\0'; /* and "\r" if any */
-            sdsupdatelen(query);
-
-            /* Now we can split the query in arguments */
-            if (sdslen(query) == 0) {
-                /* Ignore empty query */
-                sdsfree(query);
+/* Handle the result of readFromClient(). If 1 is returned there is new
+ * data to process in the query buffer, otherwise either nothing was read
+ * or the client was freed. */
+static int handleReadResult(redisClient *c) {
+    if (c->iobytes == -1) {
+        if (c->ioerr == EAGAIN) return 0;
+        redisLog(REDIS_DEBUG, "Reading from client: %s",strerror(c->ioerr));
+        freeClient(c);
+        return 0;
+    } else if (c->iobytes == 0) {
+        redisLog(REDIS_DEBUG, "Client closed connection");
+        freeClient(c);
+        return 0;
+    }
+    return 1;
+}
+
+/* Split the first line of the unparsed part of the query buffer into
+ * arguments, stored in c->argv. The buffer is not modified, c->qbpos is
+ * just moved after the line. Returns REDIS_PARSE_MORE if the buffer does
+ * not contain a full line yet. An empty line leaves c->argc set to zero. */
+static int parseInlineQuery(redisClient *c) {
+    char *line = c->querybuf+c->qbpos, *newline;
+    size_t linelen, unparsed = sdslen(c->querybuf)-c->qbpos;
+    sds *argv;
+    int argc, j;
+
+    newline = memchr(line,'\n',unparsed);
+    if (!newline)
+        return unparsed >= REDIS_INLINE_MAXLEN ?
+            REDIS_PARSE_ERR : REDIS_PARSE_MORE;
+    linelen = newline-line;
+    c->qbpos += linelen+1;
+    if (linelen && line[linelen-1] == '\r') linelen--;
+    if (linelen == 0) return REDIS_PARSE_OK; /* Empty query */
+
+    /* Now we can split the query in arguments */
+    argv = sdssplitlen(line,linelen," ",1,&argc);
+    if (argv == NULL) oom("Splitting query in token");
+    clientArgvMakeRoom(c,argc);
+    for (j = 0; j < argc; j++) {
+        if (sdslen(argv[j])) {
+            c->argv[c->argc] = argv[j];
+            c->argc++;
+        } else {
+            sdsfree(argv[j]);
+        }
+    }
+    free(argv);
+    return REDIS_PARSE_OK;
+}
+
+/* Parse "<prefix><number>\r\n" at c->qbpos into *value, moving c->qbpos
+ * after the line only on success. */
+static int parseMultibulkLine(redisClient *c, char prefix, long long min,
+        long long max, long long *value)
+{
+    char *line = c->querybuf+c->qbpos, *newline, *eptr;
+    size_t unparsed = sdslen(c->querybuf)-c->qbpos;
+    long long ll;
+
+    if (unparsed && line[0] != prefix) return REDIS_PARSE_ERR;
+    newline = memchr(line,'\r',unparsed);
+    if (!newline || (size_t)(newline-line)+1 >= unparsed)
+        return unparsed > REDIS_INLINE_MAXLEN ?
+            REDIS_PARSE_ERR : REDIS_PARSE_MORE;
+    if (newline[1] != '\n') return REDIS_PARSE_ERR;
+    errno = 0;
+    ll = strtoll(line+1,&eptr,10);
+    if (eptr != newline || eptr == line+1 || errno || ll < min || ll > max)
+        return REDIS_PARSE_ERR;
+    c->qbpos += (newline-line)+2;
+    *value = ll;
+    return REDIS_PARSE_OK;
+}
+
+/* Parse a binary safe multi bulk request: "*<argc>\r\n" followed by argc
+ * arguments in the form "$<len>\r\n<data>\r\n". The request is parsed
+ * incrementally as data arrives: c->multibulklen holds the number of
+ * arguments still to read, c->bulklen the length of the next one once
+ * its header was parsed. A request with zero arguments leaves c->argc
+ * set to zero. */
+static int parseMultibulkQuery(redisClient *c) {
+    long long ll;
+    int retval;
+
+    if (c->multibulklen == 0) {
+        /* The client was reset, read the number of arguments */
+        retval = parseMultibulkLine(c,'*',-1,REDIS_MULTIBULK_MAXARGS,&ll);
+        if (retval != REDIS_PARSE_OK) return retval;
+        if (ll <= 0) return REDIS_PARSE_OK; /* Empty query */
+        c->multibulklen = ll;
+        /* Don't trust the count for big allocations: argv grows as the
+         * arguments actually arrive. */
+        clientArgvMakeRoom(c,(ll < REDIS_MULTIBULK_INITARGS) ? ll :
+                              REDIS_MULTIBULK_INITARGS);
+    }
+    while(c->multibulklen) {
+        if (c->bulklen == -1) {
+            retval = parseMultibulkLine(c,'$',0,REDIS_BULK_MAXLEN,&ll);
+            if (retval != REDIS_PARSE_OK) return retval;
+            c->bulklen = ll+2; /* add two bytes for CR+LF */
+            prepareBulkArgument(c);
+        }
+        if ((signed)(sdslen(c->querybuf)-c->qbpos) < c->bulklen)
+            return REDIS_PARSE_MORE;
+        if (c->argc == c->argvlen) {
+            int room = c->argvlen*2;
+
+            if (room > c->argc+c->multibulklen)
+                room = c->argc+c->multibulklen;
+            clientArgvMakeRoom(c,room);
+        }
+        c->argv[c->argc] = takeBulkArgument(c);
+        c->argc++;
+        c->bulklen = -1;
+        c->multibulklen--;
+    }
+    return REDIS_PARSE_OK;
+}
+
+/* Parse the next command of the query buffer into c->argv, in the inline
+ * or multi bulk format according to its first byte. Empty requests are
+ * skipped. Only the client structure is touched, so the I/O threads can
+ * call this function too. Returns one of the REDIS_PARSE_* codes, the
+ * parser state is unchanged by errors. */
+static int parseQuery(redisClient *c) {
+    int retval;
+
+    /* Already parsed by an I/O thread? */
+    if (c->argc && c->multibulklen == 0) return REDIS_PARSE_OK;
+    while(1) {
+        if (c->reqtype == REDIS_REQ_NONE) {
+            if (c->qbpos == sdslen(c->querybuf)) return REDIS_PARSE_MORE;
+            c->reqtype = (c->querybuf[c->qbpos] == '*') ?
+                REDIS_REQ_MULTIBULK : REDIS_REQ_INLINE;
+        }
+        if (c->reqtype == REDIS_REQ_INLINE)
+            retval = parseInlineQuery(c);
+        else
+            retval = parseMultibulkQuery(c);
+        if (retval != REDIS_PARSE_OK || c->argc) return retval;
+        c->reqtype = REDIS_REQ_NONE; /* Skip the empty query */
+    }
+}
+
+/* True if the client is waiting for the bulk argument of an inline
+ * command, that processCommand() will find in c->argv */
+#define clientWaitsInlineBulk(c) \
+    ((c)->reqtype == REDIS_REQ_INLINE && (c)->bulklen != -1)
+
+/* True if the request parsed in c->argv is a GET */
+#define clientParsedGet(c) \
+    ((c)->argc == 2 && !strcasecmp((c)->argv[0],"get"))
+
+/* Execute the GET parsed in c->argv together with the GETs following it in
+ * the query buffer, so that the keys are looked up with dictFindMany() and
+ * the cache misses of the lookups overlap. Returns the result of the last
+ * parseQuery() call: on REDIS_PARSE_OK the next request is in c->argv. */
+static int processGetBatch(redisClient *c) {
+    sds keys[REDIS_GET_BATCH];
+    dictEntry *entries[REDIS_GET_BATCH];
+    int j, count = 0, retval = REDIS_PARSE_OK;
+
+    while(retval == REDIS_PARSE_OK && clientParsedGet(c) &&
+          count < REDIS_GET_BATCH)
+    {
+        keys[count++] = c->argv[1];
+        c->argv[1] = NULL;
+        resetClient(c);
+        retval = parseQuery(c);
+    }
+    dictFindMany(c->dict,(void**)keys,entries,count);
+    for (j = 0; j < count; j++) {
+        addReplyGetEntry(c,entries[j]);
+        sdsfree(keys[j]);
+    }
+    return retval;
+}
+
+/* Execute all the commands available in the client query buffer. The
+ * first one may be already parsed by an I/O thread.
+ *
+ * Parsing just advances c->qbpos, the consumed part of the buffer is
+ * trimmed once at the end, so that a pipeline of many commands received
+ * in a single read is parsed in linear time. */
+static void processInputBuffer(redisClient *c) {
+    while(1) {
+        if (clientWaitsInlineBulk(c)) {
+            /* Bulk read handling. Note that if we are at this point
+               the client already sent a command terminated with a newline,
+               we are reading the bulk data that is actually the last
+               argument of the command. */
+            if ((signed)(sdslen(c->querybuf)-c->qbpos) < c->bulklen) break;
+            /* Everything but the final CRLF is the final argument */
+            c->argv[c->argc] = takeBulkArgument(c);
+            c->argc++;
+        } else {
+            int retval = parseQuery(c);
+
+            /* Pipelined GETs are executed in batches */
+            if (retval == REDIS_PARSE_OK && clientParsedGet(c))
+                retval = processGetBatch(c);
+            if (retval == REDIS_PARSE_MORE) break;
+            if (retval == REDIS_PARSE_ERR) {
+                redisLog(REDIS_DEBUG, "Client protocol error");
+                freeClient(c);
                 return;
             }
-            argv = sdssplitlen(query,sdslen(query)," ",1,&argc);
-            sdsfree(query);
-            if (argv == NULL) oom("Splitting query in token");
-            for (j = 0; j < argc && j < REDIS_MAX_ARGS; j++) {
-                if (sdslen(argv[j])) {
-                    c->argv[c->argc] = argv[j];
-                    c->argc++;
-                } else {
-                    sdsfree(argv[j]);
-                }
-            }
-            free(argv);
-            /* Execute the command. If the client is still valid
-             * after processCommand() return and there is something
-             * on the query buffer try to process the next command. */
-            if (processCommand(c) && sdslen(c->querybuf)) goto again;
-            return;
-        } else if (sdslen(c->querybuf) >= 1024) {
-            redisLog(REDIS_DEBUG, "Client protocol error");
-            freeClient(c);
-            return;
         }
+        /* Execute the command, then process the next pipelined one if
+         * the client is still valid. */
+        if (!processCommand(c)) return;
+    }
+    if (c->qbpos) {
+        c->querybuf = sdsrange(c->querybuf,c->qbpos,-1);
+        c->qbpos = 0;
+    }
+}
+
+static void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    redisClient *c = (redisClient*) privdata;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+
+    /* With threaded I/O the read is performed in beforeSleep(), together
+     * with the reads of all the other clients ready in this iteration. */
+    if (server.iothreads > 1) {
+        if (!c->pendingread) {
+            if (!listAddNodeTail(server.pendingreads,c))
+                oom("listAddNodeTail");
+            c->pendingread = 1;
+        }
+        return;
+    }
+    readFromClient(c);
+    if (handleReadResult(c)) processInputBuffer(c);
+}
+
+/* ============================== Threaded I/O ============================== */
+
+/* When io-threads is greater than one the reads and the writes of all the
+ * clients ready in a given event loop iteration are performed in parallel.
+ * The clients are collected in server.pendingreads/pendingwrites, then
+ * beforeSleep() splits them among the I/O threads (the main thread being
+ * one of them) and waits for all the threads to finish. Commands are only
+ * executed by the main thread after all the reads are done, so the data
+ * structures don't need any locking. */
+
+static void runIOJob(redisClient *c, int op) {
+    if (op == REDIS_IO_READ) {
+        readFromClient(c);
+        if (c->iobytes > 0 && !clientWaitsInlineBulk(c)) parseQuery(c);
     } else {
-        /* Bulk read handling. Note that if we are at this point
-           the client already sent a command terminated with a newline,
-           we are reading the bulk data that is actually the last
-           argument of the command. */
-        int qbl = sdslen(c->querybuf);
-
-        if (c->bulklen <= qbl) {
-            /* Copy everything but the final CRLF as final argument */
-            c->argv[c->argc] = sdsnewlen(c->querybuf,c->bulklen-2);
-            c->argc++;
-            c->querybuf = sdsrange(c->querybuf,c->bulklen,-1);
-            processCommand(c);
-            return;
+        writeReplyList(c);
+    }
+}
+
+/* Serve the jobs of the current batch assigned to the thread 'id' */
+static void runIOJobsSlice(int id) {
+    int j;
+
+    for (j = id; j < server.ionumjobs; j += server.iothreads)
+        if (server.iojobs[j]) runIOJob(server.iojobs[j],server.ioop);
+}
+
+static void *IOThreadMain(void *arg) {
+    int id = (long) arg;
+    unsigned long gen = 0;
+
+    pthread_mutex_lock(&server.iomutex);
+    while(1) {
+        while (server.iogen == gen)
+            pthread_cond_wait(&server.iostart,&server.iomutex);
+        gen = server.iogen;
+        pthread_mutex_unlock(&server.iomutex);
+        runIOJobsSlice(id);
+        pthread_mutex_lock(&server.iomutex);
+        if (--server.iopending == 0) pthread_cond_signal(&server.iodone);
+    }
+    return NULL; /* unreached */
+}
+
+static void initIOThreads(void) {
+    int j;
+
+    if (server.iothreads == 1) return;
+    server.iogen = 0;
+    server.iopending = 0;
+    if (pthread_mutex_init(&server.iomutex,NULL) != 0 ||
+        pthread_cond_init(&server.iostart,NULL) != 0 ||
+        pthread_cond_init(&server.iodone,NULL) != 0) {
+        redisLog(REDIS_WARNING,"Fatal: can't initialize the I/O threads");
+        exit(1);
+    }
+    for (j = 1; j < server.iothreads; j++) {
+        pthread_t tid;
+
+        if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)j) != 0) {
+            redisLog(REDIS_WARNING,"Fatal: can't create the I/O threads");
+            exit(1);
         }
     }
+    redisLog(REDIS_NOTICE,"Threaded I/O enabled, %d threads",
+        server.iothreads);
+}
+
+/* Move the clients of the list 'l' in the server.iojobs batch */
+static void prepareIOJobs(list *l) {
+    int len = listLength(l);
+
+    if (len > server.iojobslen) {
+        server.iojobs = realloc(server.iojobs,sizeof(redisClient*)*len);
+        if (server.iojobs == NULL) oom("prepareIOJobs");
+        server.iojobslen = len;
+    }
+    server.ionumjobs = 0;
+    while(listLength(l)) {
+        listNode *ln = listFirst(l);
+
+        server.iojobs[server.ionumjobs++] = listNodeValue(ln);
+        listDelNode(l,ln);
+    }
+}
+
+/* Perform 'op' for every client of the current batch, and wait for the
+ * completion. With just a few clients it's not worth to wake up the
+ * threads, so the main thread does all the work. */
+static void runIOJobs(int op) {
+    int j;
+
+    if (server.iothreads == 1 || server.ionumjobs < server.iothreads*2) {
+        for (j = 0; j < server.ionumjobs; j++)
+            runIOJob(server.iojobs[j],op);
+        return;
+    }
+    pthread_mutex_lock(&server.iomutex);
+    server.ioop = op;
+    server.iopending = server.iothreads-1;
+    server.iogen++;
+    pthread_cond_broadcast(&server.iostart);
+    pthread_mutex_unlock(&server.iomutex);
+
+    runIOJobsSlice(0);
+
+    pthread_mutex_lock(&server.iomutex);
+    while(server.iopending)
+        pthread_cond_wait(&server.iodone,&server.iomutex);
+    pthread_mutex_unlock(&server.iomutex);
+}
+
+static void handleClientsWithPendingReads(void) {
+    int j;
+
+    if (listLength(server.pendingreads) == 0) return;
+    prepareIOJobs(server.pendingreads);
+    runIOJobs(REDIS_IO_READ);
+    for (j = 0; j < server.ionumjobs; j++) {
+        redisClient *c = server.iojobs[j];
+
+        if (c == NULL) continue; /* Freed while serving the batch */
+        c->pendingread = 0;
+        if (handleReadResult(c)) processInputBuffer(c);
+    }
+    server.ionumjobs = 0;
+}
+
+/* Replies accumulated while processing the events are written directly
+ * to the sockets, and only if the kernel buffer is full we install the
+ * writable event handler, so in the common request/response case no
+ * further event loop iteration is needed to deliver the reply. */
+static void handleClientsWithPendingWrites(void) {
+    int j;
+
+    if (listLength(server.pendingwrites) == 0) return;
+    prepareIOJobs(server.pendingwrites);
+    runIOJobs(REDIS_IO_WRITE);
+    for (j = 0; j < server.ionumjobs; j++) {
+        redisClient *c = server.iojobs[j];
+
+        if (c == NULL) continue; /* Freed while serving the batch */
+        c->pendingwrite = 0;
+        if (afterWriteToClient(c) == REDIS_ERR) continue;
+        if (clientHasPendingReplies(c) &&
+            aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
+                sendReplyToClient, c, NULL) == AE_ERR) freeClient(c);
+    }
+    server.ionumjobs = 0;
+}
+
+/* Called by the event loop before to sleep */
+static void beforeSleep(struct aeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+
+    handleClientsWithPendingReads();
+    handleClientsWithPendingWrites();
 }
 
 static int selectDb(redisClient *c, int id) {
@@ -786,75 +1678,124 @@ static int selectDb(redisClient *c, int id) {
     return REDIS_OK;
 }
 
+/* Create the client for the socket 'fd', that anetAccept() already set
+ * non blocking. On error the caller is in charge of closing the socket. */
 static int createClient(int fd) {
     redisClient *c = malloc(sizeof(*c));
 
-    anetNonBlock(NULL,fd);
     anetTcpNoDelay(NULL,fd);
     if (!c) return REDIS_ERR;
     selectDb(c,0);
     c->fd = fd;
     c->querybuf = sdsempty();
+    c->qbpos = 0;
+    c->argv = NULL;
     c->argc = 0;
+    c->argvlen = 0;
+    c->reqtype = REDIS_REQ_NONE;
+    c->multibulklen = 0;
     c->bulklen = -1;
     c->sentlen = 0;
+    c->bufpos = 0;
     c->lastinteraction = time(NULL);
+    c->pendingwrite = 0;
+    c->pendingread = 0;
+    c->sentobjs = 0;
     if ((c->reply = listCreate()) == NULL) oom("listCreate");
     listSetFreeMethod(c->reply,decrRefCount);
     if (aeCreateFileEvent(server.el, c->fd, AE_READABLE,
         readQueryFromClient, c, NULL) == AE_ERR) {
-        freeClient(c);
+        /* Not yet in server.clients, so freeClient() can't be used */
+        sdsfree(c->querybuf);
+        listRelease(c->reply);
+        free(c);
         return REDIS_ERR;
     }
     if (!listAddNodeTail(server.clients,c)) oom("listAddNodeTail");
     return REDIS_OK;
 }
 
+/* Called before adding data to the client reply */
+static void prepareClientToWrite(redisClient *c) {
+    /* If there is nothing to send the client is neither waiting for the
+     * writable event nor already scheduled: flush it before sleeping. */
+    if (!clientHasPendingReplies(c) && !c->pendingwrite) {
+        if (!listAddNodeTail(server.pendingwrites,c)) oom("listAddNodeTail");
+        c->pendingwrite = 1;
+    }
+}
+
+/* Copy the reply in the client buffer if there is room for it. The buffer
+ * is sent before the reply list, so it can only be used while the list is
+ * empty. Returns REDIS_ERR if the reply must go in the list instead. */
+static int addReplyToBuffer(redisClient *c, char *s, size_t len) {
+    if (listLength(c->reply) ||
+        len > sizeof(c->buf)-c->bufpos) return REDIS_ERR;
+    memcpy(c->buf+c->bufpos,s,len);
+    c->bufpos += len;
+    return REDIS_OK;
+}
+
+/* Small objects are copied in the client buffer, big ones are appended to
+ * the reply list by reference, avoiding the copy. */
 static void addReply(redisClient *c, robj *obj) {
-    if (listLength(c->reply) == 0 &&
-        aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
-        sendReplyToClient, c, NULL) == AE_ERR) return;
+    prepareClientToWrite(c);
+    if (sdslen(obj->ptr) <= REDIS_REPLY_COPY_MAX &&
+        addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) == REDIS_OK) return;
     if (!listAddNodeTail(c->reply,obj)) oom("listAddNodeTail");
     incrRefCount(obj);
 }
 
+/* Like addReply() but takes ownership of the string */
 static void addReplySds(redisClient *c, sds s) {
-    robj *o = createObject(REDIS_STRING,s);
-    addReply(c,o);
-    decrRefCount(o);
+    robj *o;
+
+    prepareClientToWrite(c);
+    if (addReplyToBuffer(c,s,sdslen(s)) == REDIS_OK) {
+        sdsfree(s);
+        return;
+    }
+    o = createObject(REDIS_STRING,s);
+    if (!listAddNodeTail(c->reply,o)) oom("listAddNodeTail");
 }
 
+/* Accept the pending connections. After a restart or a network glitch a
+ * lot of clients may reconnect at the same time, so instead of a single
+ * connection per event the accept queue is drained, up to
+ * REDIS_MAX_ACCEPTS_PER_CALL connections so that the clients already
+ * connected are not starved. */
 static void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
-    int cport, cfd;
+    int cport, cfd, max = REDIS_MAX_ACCEPTS_PER_CALL;
     char cip[128];
     REDIS_NOTUSED(el);
     REDIS_NOTUSED(mask);
     REDIS_NOTUSED(privdata);
 
-    cfd = anetAccept(server.neterr, fd, cip, &cport);
-    if (cfd == AE_ERR) {
-        redisLog(REDIS_DEBUG,"Accepting client connection: %s", server.neterr);
-        return;
-    }
-    redisLog(REDIS_DEBUG,"Accepted %s:%d", cip, cport);
-    if (createClient(cfd) == REDIS_ERR) {
-        redisLog(REDIS_WARNING,"Error allocating resoures for the client");
-        close(cfd); /* May be already closed, just ingore errors */
-        return;
+    while(max--) {
+        cfd = anetAccept(server.neterr, fd, cip, &cport);
+        if (cfd == ANET_ERR) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                redisLog(REDIS_DEBUG,"Accepting client connection: %s",
+                    server.neterr);
+                server.stat_rejected_conn++;
+            }
+            return;
+        }
+        redisLog(REDIS_DEBUG,"Accepted %s:%d", cip, cport);
+        if (createClient(cfd) == REDIS_ERR) {
+            redisLog(REDIS_WARNING,"Error allocating resoures for the client");
+            close(cfd);
+            server.stat_rejected_conn++;
+            return;
+        }
+        server.stat_numconnections++;
     }
 }
 
 /* ======================= Redis objects implementation ===================== */
 static robj *createObject(int type, void *ptr) {
-    robj *o;
+    robj *o = slabAlloc(sizeof(*o));
 
-    if (listLength(server.objfreelist)) {
-        listNode *head = listFirst(server.objfreelist);
-        o = listNodeValue(head);
-        listDelNode(server.objfreelist,head);
-    } else {
-        o = malloc(sizeof(*o));
-    }
     if (!o) oom("createObject");
     o->type = type;
     o->ptr = ptr;
@@ -896,8 +1837,7 @@ static void decrRefCount(void *obj) {
         case REDIS_SET: freeSetObject(o); break;
         default: assert(0 != 0); break;
         }
-        if (!listAddNodeHead(server.objfreelist,o))
-            free(o);
+        slabFree(o,sizeof(*o));
     }
 }
 
@@ -1140,20 +2080,21 @@ static void echoCommand(redisClient *c) {
 }
 
 static void setGenericCommand(redisClient *c, int nx) {
-    int retval;
+    dictEntry *de;
+    int added;
     robj *o;
 
     o = createObject(REDIS_STRING,c->argv[2]);
     c->argv[2] = NULL;
-    retval = dictAdd(c->dict,c->argv[1],o);
-    if (retval == DICT_ERR) {
-        if (!nx)
-            dictReplace(c->dict,c->argv[1],o);
-        else
-            decrRefCount(o);
-    } else {
+    de = dictFindOrAdd(c->dict,c->argv[1],&added);
+    if (added) {
+        dictSetHashVal(c->dict,de,o);
         /* Now the key is in the hash entry, don't free it */
         c->argv[1] = NULL;
+    } else if (!nx) {
+        dictReplaceEntryVal(c->dict,de,o);
+    } else {
+        decrRefCount(o);
     }
     server.dirty++;
     addReply(c,shared.ok);
@@ -1167,10 +2108,9 @@ static void setnxCommand(redisClient *c) {
     return setGenericCommand(c,1);
 }
 
-static void getCommand(redisClient *c) {
-    dictEntry *de;
-    
-    de = dictFind(c->dict,c->argv[1]);
+/* Reply to a GET of the key of the entry 'de', that is NULL if the key
+ * was not found */
+static void addReplyGetEntry(redisClient *c, dictEntry *de) {
     if (de == NULL) {
         addReply(c,shared.nil);
     } else {
@@ -1188,6 +2128,36 @@ static void getCommand(redisClient *c) {
     }
 }
 
+static void getCommand(redisClient *c) {
+    addReplyGetEntry(c,dictFind(c->dict,c->argv[1]));
+}
+
+/* Multi bulk reply with the values of all the keys, nil for the keys not
+ * existing or not holding a string. */
+static void mgetCommand(redisClient *c) {
+    dictEntry *entries[DICT_BATCH_SIZE];
+    int j, k, n;
+
+    addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",c->argc-1));
+    for (j = 1; j < c->argc; j += n) {
+        n = c->argc-j;
+        if (n > DICT_BATCH_SIZE) n = DICT_BATCH_SIZE;
+        dictFindMany(c->dict,(void**)c->argv+j,entries,n);
+        for (k = 0; k < n; k++) {
+            robj *o = entries[k] ? dictGetEntryVal(entries[k]) : NULL;
+
+            if (o == NULL || o->type != REDIS_STRING) {
+                addReply(c,shared.nil);
+            } else {
+                addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",
+                    (int)sdslen(o->ptr)));
+                addReply(c,o);
+                addReply(c,shared.crlf);
+            }
+        }
+    }
+}
+
 static void delCommand(redisClient *c) {
     if (dictDelete(c->dict,c->argv[1]) == DICT_OK)
         server.dirty++;
@@ -1208,11 +2178,13 @@ static void incrDecrCommand(redisClient *c, int incr) {
     dictEntry *de;
     sds newval;
     long long value;
-    int retval;
+    int added;
     robj *o;
     
-    de = dictFind(c->dict,c->argv[1]);
-    if (de == NULL) {
+    de = dictFindOrAdd(c->dict,c->argv[1],&added);
+    if (added) {
+        /* Now the key is in the hash entry, don't free it */
+        c->argv[1] = NULL;
         value = 0;
     } else {
         robj *o = dictGetEntryVal(de);
@@ -1229,13 +2201,10 @@ static void incrDecrCommand(redisClient *c, int incr) {
     value += incr;
     newval = sdscatprintf(sdsempty(),"%lld",value);
     o = createObject(REDIS_STRING,newval);
-    retval = dictAdd(c->dict,c->argv[1],o);
-    if (retval == DICT_ERR) {
-        dictReplace(c->dict,c->argv[1],o);
-    } else {
-        /* Now the key is in the hash entry, don't free it */
-        c->argv[1] = NULL;
-    }
+    if (added)
+        dictSetHashVal(c->dict,de,o);
+    else
+        dictReplaceEntryVal(c->dict,de,o);
     server.dirty++;
     addReply(c,o);
     addReply(c,shared.crlf);
@@ -1253,7 +2222,7 @@ static void selectCommand(redisClient *c) {
     int id = atoi(c->argv[1]);
     
     if (selectDb(c,id) == REDIS_ERR) {
-        addReplySds(c,"-ERR invalid DB index\r\n");
+        addReplySds(c,sdsnew("-ERR invalid DB index\r\n"));
     } else {
         addReply(c,shared.ok);
     }
@@ -1297,6 +2266,89 @@ static void keysCommand(redisClient *c) {
     addReplySds(c,reply);
 }
 
+typedef struct scanData {
+    list *keys;
+    sds pattern;                /* NULL to return all the keys */
+} scanData;
+
+static void scanCallback(void *privdata, const dictEntry *de) {
+    scanData *sd = privdata;
+    sds key = dictGetEntryKey(de);
+
+    if (sd->pattern && !stringmatchlen(sd->pattern,sdslen(sd->pattern),
+                                       key,sdslen(key),0)) return;
+    if (!listAddNodeTail(sd->keys,sdsdup(key))) oom("listAddNodeTail");
+}
+
+/* SCAN cursor [MATCH pattern] [COUNT count]
+ *
+ * Incremental alternative to KEYS: every call visits a few buckets of the
+ * DB, about 'count' keys, starting at 'cursor' (0 the first time). The
+ * reply is a multi bulk whose first element is the cursor for the next
+ * call, 0 when the iteration is complete, followed by the keys found.
+ * Keys present for the whole iteration are returned at least once, even
+ * if the DB is resized in the meantime. */
+static void scanCommand(redisClient *c) {
+    unsigned long cursor;
+    long count = REDIS_SCAN_COUNT, maxiterations;
+    char *eptr;
+    scanData sd;
+    listNode *ln;
+    sds cur;
+    int j;
+
+    errno = 0;
+    cursor = strtoul(c->argv[1],&eptr,10);
+    if (c->argv[1][0] == '\0' || c->argv[1][0] == '-' || *eptr != '\0' ||
+        errno == ERANGE)
+    {
+        addReplySds(c,sdsnew("-ERR invalid cursor\r\n"));
+        return;
+    }
+    sd.pattern = NULL;
+    for (j = 2; j < c->argc; j += 2) {
+        if (j+1 < c->argc && !strcasecmp(c->argv[j],"match")) {
+            sd.pattern = c->argv[j+1];
+            if (!strcmp(sd.pattern,"*")) sd.pattern = NULL;
+        } else if (j+1 < c->argc && !strcasecmp(c->argv[j],"count")) {
+            errno = 0;
+            count = strtol(c->argv[j+1],&eptr,10);
+            if (count < 1 || *eptr != '\0' || errno == ERANGE) {
+                addReplySds(c,sdsnew("-ERR invalid count\r\n"));
+                return;
+            }
+            /* COUNT is just a hint: clamp it so count*10 can't overflow */
+            if (count > REDIS_SCAN_MAX_COUNT) count = REDIS_SCAN_MAX_COUNT;
+        } else {
+            addReplySds(c,sdsnew("-ERR syntax error\r\n"));
+            return;
+        }
+    }
+
+    /* Visit buckets until 'count' keys are collected. With a pattern
+     * matching few keys bound the work with the number of buckets too. */
+    if ((sd.keys = listCreate()) == NULL) oom("listCreate");
+    maxiterations = count*10;
+    do {
+        cursor = dictScan(c->dict,cursor,scanCallback,&sd);
+    } while(cursor && --maxiterations && (long)listLength(sd.keys) < count);
+
+    addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",listLength(sd.keys)+1));
+    cur = sdscatprintf(sdsempty(),"%lu",cursor);
+    addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n%s\r\n",
+        (int)sdslen(cur),cur));
+    sdsfree(cur);
+    while((ln = listFirst(sd.keys)) != NULL) {
+        sds key = listNodeValue(ln);
+
+        addReplySds(c,sdscatprintf(sdsempty(),"%d\r\n",(int)sdslen(key)));
+        addReplySds(c,key);
+        addReply(c,shared.crlf);
+        listDelNode(sd.keys,ln);
+    }
+    listRelease(sd.keys);
+}
+
 static void dbsizeCommand(redisClient *c) {
     addReplySds(c,
         sdscatprintf(sdsempty(),"%lu\r\n",dictGetHashTableUsed(c->dict)));
@@ -1339,7 +2391,8 @@ static void shutdownCommand(redisClient *c) {
 }
 
 static void renameGenericCommand(redisClient *c, int nx) {
-    dictEntry *de;
+    dictEntry *de, *dstde;
+    int added;
     robj *o;
 
     /* To use the same key as src and dst is probably an error */
@@ -1354,16 +2407,17 @@ static void renameGenericCommand(redisClient *c, int nx) {
         return;
     }
     o = dictGetEntryVal(de);
+    dstde = dictFindOrAdd(c->dict,c->argv[2],&added);
+    if (!added && nx) {
+        addReplySds(c,sdsnew("-ERR destination key exists\r\n"));
+        return;
+    }
     incrRefCount(o);
-    if (dictAdd(c->dict,c->argv[2],o) == DICT_ERR) {
-        if (nx) {
-            decrRefCount(o);
-            addReplySds(c,sdsnew("-ERR destination key exists\r\n"));
-            return;
-        }
-        dictReplace(c->dict,c->argv[2],o);
-    } else {
+    if (added) {
+        dictSetHashVal(c->dict,dstde,o);
         c->argv[2] = NULL;
+    } else {
+        dictReplaceEntryVal(c->dict,dstde,o);
     }
     dictDelete(c->dict,c->argv[1]);
     server.dirty++;
@@ -1379,9 +2433,9 @@ static void renamenxCommand(redisClient *c) {
 }
 
 static void moveCommand(redisClient *c) {
-    dictEntry *de;
-    sds *key;
-    robj *o;
+    dictEntry *de, *dstde;
+    sds key;
+    int added;
     dict *src, *dst;
 
     /* Obtain source and target DB pointers */
@@ -1407,16 +2461,20 @@ static void moveCommand(redisClient *c) {
         return;
     }
 
-    /* Try to add the element to the target DB */
-    key = dictGetEntryKey(de);
-    o = dictGetEntryVal(de);
-    if (dictAdd(dst,key,o) == DICT_ERR) {
+    /* Try to add the element to the target DB. The key may be embedded
+     * in the source entry, so the target DB gets its own copy. */
+    key = sdsdup(dictGetEntryKey(de));
+    dstde = dictFindOrAdd(dst,key,&added);
+    if (!added) {
+        sdsfree(key);
         addReplySds(c,sdsnew("-ERR target DB already contains the moved key\r\n"));
         return;
     }
+    incrRefCount((robj*)dictGetEntryVal(de));
+    dictSetHashVal(dst,dstde,dictGetEntryVal(de));
 
     /* OK! key moved, free the entry in the source DB */
-    dictDeleteNoFree(src,c->argv[1]);
+    dictDelete(src,c->argv[1]);
     server.dirty++;
     addReply(c,shared.ok);
 }
@@ -1425,12 +2483,13 @@ static void pushGenericCommand(redisClient *c, int where) {
     robj *ele, *lobj;
     dictEntry *de;
     list *list;
+    int added;
     
     ele = createObject(REDIS_STRING,c->argv[2]);
     c->argv[2] = NULL;
 
-    de = dictFind(c->dict,c->argv[1]);
-    if (de == NULL) {
+    de = dictFindOrAdd(c->dict,c->argv[1],&added);
+    if (added) {
         lobj = createListObject();
         list = lobj->ptr;
         if (where == REDIS_HEAD) {
@@ -1438,7 +2497,7 @@ static void pushGenericCommand(redisClient *c, int where) {
         } else {
             if (!listAddNodeTail(list,ele)) oom("listAddNodeTail");
         }
-        dictAdd(c->dict,c->argv[1],lobj);
+        dictSetHashVal(c->dict,de,lobj);
 
         /* Now the key is in the hash entry, don't free it */
         c->argv[1] = NULL;
@@ -1666,12 +2725,17 @@ static void ltrimCommand(redisClient *c) {
 /* =================================== Main! ================================ */
 
 int main(int argc, char **argv) {
-    REDIS_NOTUSED(argc);
-    REDIS_NOTUSED(argv);
-
+    initServerConfig();
+    if (argc == 2) {
+        loadServerConfig(argv[1]);
+    } else if (argc > 2) {
+        fprintf(stderr,"Usage: ./redis-server [/path/to/redis.conf]\n");
+        exit(1);
+    }
     initServer();
     if (aeCreateFileEvent(server.el, server.fd, AE_READABLE,
         acceptHandler, NULL, NULL) == AE_ERR) oom("creating file event");
+    aeSetBeforeSleepProc(server.el,beforeSleep);
     aeMain(server.el);
     aeDeleteEventLoop(server.el);
     return 0;
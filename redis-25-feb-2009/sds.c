@@ -31,6 +31,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <assert.h>
 
 static void sdsOomAbort(void) {
     fprintf(stderr,"SDS: Out Of Memory (SDS_ABORT_ON_OOM defined)\n");
@@ -60,6 +61,19 @@ sds sdsempty(void) {
     return sdsnewlen("",0);
 }
 
+/* Like sdsnewlen() but the string is created inside 'buf', that must be at
+ * least sdsAllocLen(initlen) bytes. The result must never be passed to
+ * sdsfree() or to functions that may reallocate it. */
+sds sdsnewlenInPlace(void *buf, const void *init, size_t initlen) {
+    struct sdshdr *sh = buf;
+
+    sh->len = initlen;
+    sh->free = 0;
+    memcpy(sh->buf, init, initlen);
+    sh->buf[initlen] = '\0';
+    return (char*)sh->buf;
+}
+
 sds sdsnew(const char *init) {
     size_t initlen = (init == NULL) ? 0 : strlen(init);
     return sdsnewlen(init, initlen);
@@ -91,7 +105,7 @@ void sdsupdatelen(sds s) {
     sh->len = reallen;
 }
 
-static sds sdsMakeRoomFor(sds s, size_t addlen) {
+static sds _sdsMakeRoomFor(sds s, size_t addlen, int greedy) {
     struct sdshdr *sh, *newsh;
     size_t free = sdsavail(s);
     size_t len, newlen;
@@ -99,7 +113,13 @@ static sds sdsMakeRoomFor(sds s, size_t addlen) {
     if (free >= addlen) return s;
     len = sdslen(s);
     sh = (void*) (s-(sizeof(struct sdshdr)));
-    newlen = (len+addlen)*2;
+    newlen = len+addlen;
+    if (greedy) {
+        if (newlen < SDS_MAX_PREALLOC)
+            newlen *= 2;
+        else
+            newlen += SDS_MAX_PREALLOC;
+    }
     newsh = realloc(sh, sizeof(struct sdshdr)+newlen+1);
 #ifdef SDS_ABORT_ON_OOM
     if (newsh == NULL) sdsOomAbort();
@@ -111,6 +131,50 @@ static sds sdsMakeRoomFor(sds s, size_t addlen) {
     return newsh->buf;
 }
 
+/* Enlarge the free space at the end of the sds string so that the caller
+ * is sure that after calling this function can overwrite up to addlen
+ * bytes after the end of the string, plus one more byte for nul term.
+ * The buffer is doubled while small, but grows by SDS_MAX_PREALLOC at most
+ * once large, to avoid wasting half of a big allocation. */
+sds sdsMakeRoomFor(sds s, size_t addlen) {
+    return _sdsMakeRoomFor(s,addlen,1);
+}
+
+/* Like sdsMakeRoomFor() but allocates exactly addlen more bytes, for when
+ * the final size of the string is known in advance. */
+sds sdsMakeRoomForNonGreedy(sds s, size_t addlen) {
+    return _sdsMakeRoomFor(s,addlen,0);
+}
+
+/* Increment the length of the string by 'incr' bytes, written by the
+ * caller after the end of the string (in the space obtained with
+ * sdsMakeRoomFor()), and set the nul term. Used to read(2) directly into
+ * an sds string without an intermediate buffer. */
+void sdsIncrLen(sds s, size_t incr) {
+    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
+
+    assert(sh->free >= (long)incr);
+    sh->len += incr;
+    sh->free -= incr;
+    s[sh->len] = '\0';
+}
+
+/* Release the free space at the end of the string. The string is
+ * reallocated, so the returned pointer must be used. */
+sds sdsRemoveFreeSpace(sds s) {
+    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
+
+    if (sh->free == 0) return s;
+    sh = realloc(sh, sizeof(struct sdshdr)+sh->len+1);
+#ifdef SDS_ABORT_ON_OOM
+    if (sh == NULL) sdsOomAbort();
+#else
+    if (sh == NULL) return s;
+#endif
+    sh->free = 0;
+    return sh->buf;
+}
+
 sds sdscatlen(sds s, void *t, size_t len) {
     struct sdshdr *sh;
     size_t curlen = sdslen(s);
@@ -151,7 +215,7 @@ sds sdscpy(sds s, char *t) {
 }
 
 sds sdscatprintf(sds s, const char *fmt, ...) {
-    va_list ap;
+    va_list ap, cpy;
     char *buf, *t;
     size_t buflen = 32;
 
@@ -164,7 +228,9 @@ sds sdscatprintf(sds s, const char *fmt, ...) {
         if (buf == NULL) return NULL;
 #endif
         buf[buflen-2] = '\0';
-        vsnprintf(buf, buflen, fmt, ap);
+        va_copy(cpy,ap);
+        vsnprintf(buf, buflen, fmt, cpy);
+        va_end(cpy);
         if (buf[buflen-2] != '\0') {
             free(buf);
             buflen *= 2;
@@ -185,8 +251,8 @@ sds sdstrim(sds s, const char *cset) {
 
     sp = start = s;
     ep = end = s+sdslen(s)-1;
-    while(sp < end && strchr(cset, *sp)) sp++;
-    while(ep > start && strchr(cset, *ep)) ep--;
+    while(sp <= end && strchr(cset, *sp)) sp++;
+    while(ep > sp && strchr(cset, *ep)) ep--;
     len = (sp > ep) ? 0 : ((ep-sp)+1);
     if (sh->buf != sp) memmove(sh->buf, sp, len);
     sh->buf[len] = '\0';
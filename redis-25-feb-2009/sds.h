@@ -30,15 +30,25 @@
 
 #include <sys/types.h>
 
+#define SDS_MAX_PREALLOC (1024*1024)
+
 typedef char *sds;
 
+/* Bytes needed by sdsnewlenInPlace() for a string of len bytes */
+#define sdsAllocLen(len) (sizeof(struct sdshdr)+(len)+1)
+
 struct sdshdr {
     long len;
     long free;
     char buf[0];
 };
 
+/* Like sdslen() but inlined, for the hot paths */
+#define sdsHdrLen(s) \
+    (((struct sdshdr*)((const char*)(s)-sizeof(struct sdshdr)))->len)
+
 sds sdsnewlen(const void *init, size_t initlen);
+sds sdsnewlenInPlace(void *buf, const void *init, size_t initlen);
 sds sdsnew(const char *init);
 sds sdsempty();
 size_t sdslen(const sds s);
@@ -56,5 +66,9 @@ void sdsupdatelen(sds s);
 int sdscmp(sds s1, sds s2);
 sds *sdssplitlen(char *s, int len, char *sep, int seplen, int *count);
 void sdstolower(sds s);
+sds sdsMakeRoomFor(sds s, size_t addlen);
+sds sdsMakeRoomForNonGreedy(sds s, size_t addlen);
+void sdsIncrLen(sds s, size_t incr);
+sds sdsRemoveFreeSpace(sds s);
 
 #endif
@@ -0,0 +1,175 @@
+/* slab.c - Size class allocator for small fixed size structures
+ * Copyright (C) 2009 Salvatore Sanfilippo <antirez@invece.org>
+ * This software is released under the GPL license version 2.0
+ *
+ * Hash table entries, objects and list nodes are small and allocated and
+ * freed all the time. Here objects of the same size class are carved from
+ * SLAB_SIZE bytes slabs, aligned to SLAB_SIZE so that the slab of an object
+ * is found masking its address. Freed objects are linked in the free list
+ * of their slab using their own first word, so freeing never allocates.
+ *
+ * Slabs with free objects are linked in a list per size class. A slab that
+ * becomes empty is kept for reuse only if the class has less than
+ * SLAB_MAX_EMPTY empty slabs, otherwise it is returned to the system, so
+ * the memory used after a spike of allocations is given back.
+ *
+ * The allocator is not thread safe: in Redis it's only used by the main
+ * thread, the I/O threads never allocate or free these structures. The
+ * first thread calling slabAlloc() becomes the owner of the slabs, and
+ * (unless NDEBUG is defined) every call from another thread aborts. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include "slab.h"
+
+typedef struct slab {
+    struct slab *prev, *next;   /* slabs of the class with free objects */
+    void *freelist;             /* freed objects */
+    char *bump;                 /* objects never allocated start here */
+    char *end;
+    unsigned int used;          /* objects in use */
+    unsigned int objects;       /* objects that fit in the slab */
+} slab;
+
+typedef struct slabClass {
+    slab *head, *tail;          /* slabs with free objects */
+    unsigned long slabs;
+    unsigned long empty;
+    unsigned long used;
+} slabClass;
+
+/* Objects start after the header, aligned to a pointer at least */
+#define SLAB_HDR_SIZE (((sizeof(slab)+SLAB_CLASS_STEP-1)/SLAB_CLASS_STEP)*SLAB_CLASS_STEP)
+
+static slabClass classes[SLAB_CLASSES];
+
+#ifndef NDEBUG
+static pthread_t owner;
+static int ownerset = 0;
+
+/* True if called by the thread that owns the slabs */
+static int slabOwnerThread(void) {
+    if (!ownerset) {
+        owner = pthread_self();
+        ownerset = 1;
+    }
+    return pthread_equal(owner,pthread_self());
+}
+#endif
+
+static int slabClassIndex(size_t size) {
+    return (size+SLAB_CLASS_STEP-1)/SLAB_CLASS_STEP-1;
+}
+
+static slab *slabOf(void *ptr) {
+    return (slab*)((uintptr_t)ptr & ~((uintptr_t)SLAB_SIZE-1));
+}
+
+static void slabUnlink(slabClass *c, slab *s) {
+    if (s->prev) s->prev->next = s->next; else c->head = s->next;
+    if (s->next) s->next->prev = s->prev; else c->tail = s->prev;
+    s->prev = s->next = NULL;
+}
+
+static void slabLinkHead(slabClass *c, slab *s) {
+    s->prev = NULL;
+    s->next = c->head;
+    if (c->head) c->head->prev = s; else c->tail = s;
+    c->head = s;
+}
+
+static void slabLinkTail(slabClass *c, slab *s) {
+    s->next = NULL;
+    s->prev = c->tail;
+    if (c->tail) c->tail->next = s; else c->head = s;
+    c->tail = s;
+}
+
+static slab *slabCreate(int clsidx) {
+    size_t size = (clsidx+1)*SLAB_CLASS_STEP;
+    void *mem;
+    slab *s;
+
+    if (posix_memalign(&mem,SLAB_SIZE,SLAB_SIZE) != 0) return NULL;
+    s = mem;
+    s->prev = s->next = NULL;
+    s->freelist = NULL;
+    s->bump = (char*)s+SLAB_HDR_SIZE;
+    s->objects = (SLAB_SIZE-SLAB_HDR_SIZE)/size;
+    s->end = s->bump+s->objects*size;
+    s->used = 0;
+    return s;
+}
+
+void *slabAlloc(size_t size) {
+    slabClass *c;
+    slab *s;
+    void *ptr;
+    int clsidx;
+
+    if (size == 0 || size > SLAB_MAX_OBJ) return malloc(size);
+    assert(slabOwnerThread());
+    clsidx = slabClassIndex(size);
+    c = &classes[clsidx];
+    if ((s = c->head) == NULL) {
+        if ((s = slabCreate(clsidx)) == NULL) return NULL;
+        slabLinkHead(c,s);
+        c->slabs++;
+        c->empty++;
+    }
+
+    /* Reuse freed objects first, then take never used memory */
+    if (s->freelist) {
+        ptr = s->freelist;
+        s->freelist = *(void**)ptr;
+    } else {
+        ptr = s->bump;
+        s->bump += (clsidx+1)*SLAB_CLASS_STEP;
+    }
+    if (s->used++ == 0) c->empty--;
+    if (s->used == s->objects) slabUnlink(c,s); /* full */
+    c->used++;
+    return ptr;
+}
+
+/* 'size' must be the size used to allocate 'ptr' */
+void slabFree(void *ptr, size_t size) {
+    slabClass *c;
+    slab *s;
+
+    if (ptr == NULL) return;
+    if (size == 0 || size > SLAB_MAX_OBJ) {
+        free(ptr);
+        return;
+    }
+    assert(slabOwnerThread());
+    c = &classes[slabClassIndex(size)];
+    s = slabOf(ptr);
+    *(void**)ptr = s->freelist;
+    s->freelist = ptr;
+    if (s->used-- == s->objects) slabLinkHead(c,s); /* was full */
+    c->used--;
+    if (s->used == 0) {
+        slabUnlink(c,s);
+        if (c->empty >= SLAB_MAX_EMPTY) {
+            free(s);
+            c->slabs--;
+        } else {
+            /* Used last, so that partially used slabs get filled first */
+            slabLinkTail(c,s);
+            c->empty++;
+        }
+    }
+}
+
+void slabGetStats(int clsidx, slabStats *stats) {
+    slabClass *c = &classes[clsidx];
+
+    stats->size = (clsidx+1)*SLAB_CLASS_STEP;
+    stats->slabs = c->slabs;
+    stats->empty = c->empty;
+    stats->used = c->used;
+    stats->capacity = c->slabs*((SLAB_SIZE-SLAB_HDR_SIZE)/stats->size);
+}
@@ -0,0 +1,29 @@
+/* slab.c - Size class allocator for small fixed size structures
+ * Copyright (C) 2009 Salvatore Sanfilippo <antirez@invece.org>
+ * This software is released under the GPL license version 2.0 */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+#define SLAB_SIZE           (1024*64) /* slabs are also aligned to this */
+#define SLAB_CLASS_STEP     8         /* object sizes are multiples of this */
+#define SLAB_MAX_OBJ        256       /* bigger allocations use malloc() */
+#define SLAB_CLASSES        (SLAB_MAX_OBJ/SLAB_CLASS_STEP)
+#define SLAB_MAX_EMPTY      4         /* empty slabs kept per class */
+
+typedef struct slabStats {
+    size_t size;            /* object size of the class */
+    unsigned long slabs;    /* slabs allocated */
+    unsigned long empty;    /* slabs without objects, kept for reuse */
+    unsigned long used;     /* objects in use */
+    unsigned long capacity; /* objects that fit in all the slabs */
+} slabStats;
+
+/* Prototypes */
+void *slabAlloc(size_t size);
+void slabFree(void *ptr, size_t size);
+void slabGetStats(int clsidx, slabStats *stats);
+
+#endif /* __SLAB_H__ */
@@ -131,12 +131,155 @@ proc main {server port} {
         format $res
     } {1xyzk1}
 
+    test {Commands pipelining after a bulk received in a different read} {
+        puts -nonewline $fd "SET k1 4\r\n"
+        flush $fd
+        after 100
+        puts -nonewline $fd "abcd\r\nGET k1\r\n"
+        flush $fd
+        set res {}
+        append res [string match +OK* [redis_read_retcode $fd]]
+        append res [redis_bulk_read $fd]
+        format $res
+    } {1abcd}
+
+    test {Pipelining of more commands than a single read can get} {
+        puts -nonewline $fd [string repeat "PING\r\n" 20000]
+        flush $fd
+        set pongs 0
+        for {set j 0} {$j < 20000} {incr j} {
+            if {[string match +PONG* [redis_read_retcode $fd]]} {incr pongs}
+        }
+        format $pongs
+    } {20000}
+
+    test {Pipelined GETs mixed with other commands} {
+        redis_set $fd k1 a
+        redis_set $fd k2 b
+        puts -nonewline $fd "GET k1\r\nGET nokey\r\nGET k2\r\nSET k1 1\r\nc\r\nGET k1\r\n"
+        flush $fd
+        set res {}
+        append res [redis_bulk_read $fd]
+        append res [redis_bulk_read $fd]
+        append res [redis_bulk_read $fd]
+        append res [string match +OK* [redis_read_retcode $fd]]
+        append res [redis_bulk_read $fd]
+        format $res
+    } {ab1c}
+
+    test {MGET} {
+        redis_lpush $fd mgetlist x
+        set res [redis_mget $fd k1 nokey mgetlist k2]
+        redis_del $fd mgetlist
+        format $res
+    } {c {} {} b}
+
+    test {Replies bigger than the reply buffer are sent in order} {
+        set big [string repeat x 10000]
+        set huge [string repeat y 20000]
+        redis_set $fd big $big
+        redis_set $fd huge $huge
+        redis_set $fd small abc
+        puts -nonewline $fd "GET small\r\nGET big\r\nGET big\r\nPING\r\nGET small\r\nGET huge\r\nGET small\r\nPING\r\n"
+        flush $fd
+        set res {}
+        lappend res [redis_bulk_read $fd]
+        lappend res [expr {[redis_bulk_read $fd] eq $big}]
+        lappend res [expr {[redis_bulk_read $fd] eq $big}]
+        lappend res [redis_read_retcode $fd]
+        lappend res [redis_bulk_read $fd]
+        lappend res [expr {[redis_bulk_read $fd] eq $huge}]
+        lappend res [redis_bulk_read $fd]
+        lappend res [redis_read_retcode $fd]
+        redis_del $fd big
+        redis_del $fd huge
+        redis_del $fd small
+        format $res
+    } {abc 1 1 +PONG abc 1 abc +PONG}
+
+    test {Multi bulk request with binary safe arguments} {
+        puts -nonewline $fd "*3\r\n\$3\r\nSET\r\n\$7\r\nfoo bar\r\n\$4\r\na\r\nb\r\n"
+        puts -nonewline $fd "*2\r\n\$3\r\nGET\r\n\$7\r\nfoo bar\r\n"
+        flush $fd
+        set res {}
+        append res [string match +OK* [redis_read_retcode $fd]]
+        append res [redis_bulk_read $fd]
+        puts -nonewline $fd "*2\r\n\$3\r\nDEL\r\n\$7\r\nfoo bar\r\n"
+        flush $fd
+        append res [string match +OK* [redis_read_retcode $fd]]
+        format $res
+    } "1a\r\nb1"
+
+    test {Multi bulk request with thousands of arguments} {
+        redis_set $fd manyargs ok
+        set req "*5001\r\n\$4\r\nMGET\r\n"
+        for {set j 0} {$j < 5000} {incr j} {
+            set key [expr {$j == 4999 ? "manyargs" : "nokey$j"}]
+            append req "\$[string length $key]\r\n$key\r\n"
+        }
+        redis_write_chunks $fd $req 10000
+        set count [redis_read_integer $fd]
+        for {set j 0} {$j < $count} {incr j} {
+            set res [redis_bulk_read $fd]
+        }
+        redis_del $fd manyargs
+        list $count $res
+    } {5000 ok}
+
+    test {Multi bulk request received in small chunks} {
+        foreach chunk {"*2\r" "\n\$4" "\r\nE" "CHO\r\n\$3\r\nabc\r" "\n"} {
+            puts -nonewline $fd $chunk
+            flush $fd
+            after 10
+        }
+        redis_bulk_read $fd
+    } {abc}
+
+    test {Big inline bulk argument received in several writes} {
+        set val [redis_test_value 100000]
+        redis_write_chunks $fd "SET bigval 100000\r\n$val\r\n" 30000
+        set res [string match +OK* [redis_read_retcode $fd]]
+        append res [expr {[redis_get $fd bigval] eq $val}]
+    } {11}
+
+    test {Big multi bulk argument received in several writes} {
+        set val [redis_test_value 100000]
+        set req "*3\r\n\$3\r\nSET\r\n\$6\r\nbigval\r\n\$100000\r\n$val\r\n"
+        redis_write_chunks $fd $req 30000
+        set res [string match +OK* [redis_read_retcode $fd]]
+        append res [expr {[redis_get $fd bigval] eq $val}]
+    } {11}
+
+    test {Big bulk arguments followed by pipelined commands} {
+        set val1 [redis_test_value 100000]
+        set val2 [string reverse $val1]
+        set req "SET bigval 100000\r\n$val1\r\nGET bigval\r\n"
+        append req "*3\r\n\$3\r\nSET\r\n\$7\r\nbigval2\r\n\$100000\r\n$val2\r\n"
+        append req "*2\r\n\$3\r\nGET\r\n\$7\r\nbigval2\r\nPING\r\n"
+        redis_write_chunks $fd $req 70000
+        set res [string match +OK* [redis_read_retcode $fd]]
+        append res [expr {[redis_bulk_read $fd] eq $val1}]
+        append res [string match +OK* [redis_read_retcode $fd]]
+        append res [expr {[redis_bulk_read $fd] eq $val2}]
+        append res [string match +PONG* [redis_read_retcode $fd]]
+        redis_del $fd bigval
+        redis_del $fd bigval2
+        format $res
+    } {11111}
+
     test {Non existing command} {
         puts -nonewline $fd "foo\r\n"
         flush $fd
         string match -ERR* [redis_read_retcode $fd]
     } {1}
 
+    test {Command names are case insensitive} {
+        puts -nonewline $fd "PiNg\r\nECHO 3\r\nabc\r\n"
+        flush $fd
+        set res [redis_read_retcode $fd]
+        append res [redis_bulk_read $fd]
+    } {+PONGabc}
+
     test {Basic LPUSH, RPUSH, LLENGTH, LINDEX} {
         redis_lpush $fd mylist a
         redis_lpush $fd mylist b
@@ -279,6 +422,12 @@ proc main {server port} {
         redis_move $fd mykey 1
     } {-ERR*}
 
+    test {SELECT against an invalid DB index} {
+        set res [redis_select $fd 100000]
+        redis_writenl $fd ping
+        append res [redis_read_retcode $fd]
+    } {-ERR invalid DB index+PONG}
+
     test {SET/GET keys in different DBs} {
         redis_set $fd a hello
         redis_set $fd b world
@@ -308,6 +457,45 @@ proc main {server port} {
         redis_lpop $fd mylist
     } {}
 
+    test {SCAN returns all the keys matching the pattern} {
+        for {set j 0} {$j < 1000} {incr j} {
+            redis_set $fd scankey:$j x
+        }
+        set keys {}
+        set cursor 0
+        while 1 {
+            set res [redis_scan $fd $cursor MATCH scankey:* COUNT 50]
+            set cursor [lindex $res 0]
+            eval lappend keys [lrange $res 1 end]
+            if {$cursor == 0} break
+        }
+        for {set j 0} {$j < 1000} {incr j} {
+            redis_del $fd scankey:$j
+        }
+        llength [lsort -unique $keys]
+    } {1000}
+
+    test {SCAN with a huge COUNT returns all the keys in one call} {
+        for {set j 0} {$j < 100} {incr j} {
+            redis_set $fd scankey:$j x
+        }
+        set res [redis_scan $fd 0 MATCH scankey:* COUNT 9223372036854775807]
+        for {set j 0} {$j < 100} {incr j} {
+            redis_del $fd scankey:$j
+        }
+        list [lindex $res 0] [llength [lsort -unique [lrange $res 1 end]]]
+    } {0 100}
+
+    test {SCAN cursor and COUNT out of range are errors} {
+        set res {}
+        foreach args {{18446744073709551616} {0 COUNT 9223372036854775808}
+                      {0 COUNT -9223372036854775809}} {
+            redis_writenl $fd "scan [join $args]"
+            lappend res [redis_read_retcode $fd]
+        }
+        format $res
+    } {{-ERR invalid cursor} {-ERR invalid count} {-ERR invalid count}}
+
     puts "\n[expr $::passed+$::failed] tests, $::passed passed, $::failed failed"
     if {$::failed > 0} {
         puts "\n*** WARNING!!! $::failed FAILED TESTS ***\n"
@@ -332,6 +520,24 @@ proc redis_writenl {fd buf} {
     flush $fd
 }
 
+# Send 'buf' in writes of 'chunklen' bytes, each in its own packet
+proc redis_write_chunks {fd buf chunklen} {
+    for {set j 0} {$j < [string length $buf]} {incr j $chunklen} {
+        puts -nonewline $fd [string range $buf $j [expr {$j+$chunklen-1}]]
+        flush $fd
+        after 20
+    }
+}
+
+# A value of 'len' bytes that doesn't repeat a short pattern, with CRLFs
+proc redis_test_value len {
+    set val {}
+    for {set j 0} {[string length $val] < $len} {incr j} {
+        append val "$j\r\n"
+    }
+    string range $val 0 [expr {$len-1}]
+}
+
 proc redis_readnl {fd len} {
     set buf [read $fd $len]
     read $fd 2 ; # discard CR LF
@@ -374,6 +580,26 @@ proc redis_get {fd key} {
     redis_bulk_read $fd
 }
 
+proc redis_mget {fd args} {
+    redis_writenl $fd "mget [join $args]"
+    set count [redis_read_integer $fd]
+    set res {}
+    for {set j 0} {$j < $count} {incr j} {
+        lappend res [redis_bulk_read $fd]
+    }
+    return $res
+}
+
+proc redis_scan {fd cursor args} {
+    redis_writenl $fd "scan $cursor [join $args]"
+    set count [redis_read_integer $fd]
+    set res {}
+    for {set j 0} {$j < $count} {incr j} {
+        lappend res [redis_bulk_read $fd]
+    }
+    return $res
+}
+
 proc redis_select {fd id} {
     redis_writenl $fd "select $id"
     redis_read_retcode $fd